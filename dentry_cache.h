@@ -0,0 +1,58 @@
+#pragma once
+
+#include "dir_tree.h"
+#include <list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace cs5250 {
+
+// Least recently used map from a path, as it was given, to the node it
+// resolved to. Node ids are never reused, so the caller only has to check
+// that a hit has not been removed since.
+class DentryCache {
+  private:
+    struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+
+    using Item = std::pair<std::string, NodeId>;
+
+    size_t capacity_;
+    std::list<Item> items_;
+    std::unordered_map<std::string, std::list<Item>::iterator, StringHash,
+                       std::equal_to<>>
+        by_path_;
+
+  public:
+    explicit DentryCache(size_t capacity = 4096) : capacity_(capacity) {}
+
+    std::optional<NodeId> Find(std::string_view path) {
+        auto it = by_path_.find(path);
+        if (it == by_path_.end())
+            return std::nullopt;
+        items_.splice(items_.begin(), items_, it->second);
+        return it->second->second;
+    }
+
+    void Insert(std::string_view path, NodeId id) {
+        if (auto it = by_path_.find(path); it != by_path_.end()) {
+            it->second->second = id;
+            items_.splice(items_.begin(), items_, it->second);
+            return;
+        }
+        if (items_.size() >= capacity_) {
+            by_path_.erase(items_.back().first);
+            items_.pop_back();
+        }
+        items_.emplace_front(std::string(path), id);
+        by_path_.emplace(items_.front().first, items_.begin());
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,186 @@
+#include "dir_index.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cs5250 {
+
+uint64_t HashBytes(const uint8_t *data, size_t size, uint64_t seed) {
+    constexpr uint64_t k1 = 0x87c37b91114253d5ULL;
+    constexpr uint64_t k2 = 0x4cf5ad432745937fULL;
+    auto h = seed ^ (size * k2);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word *= k1;
+        word = (word << 31) | (word >> 33);
+        h ^= word * k2;
+        h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    h ^= tail * k1;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+DirIndex::DirIndex(uint8_t *data, size_t size) : data_(data), size_(size) {
+    header_ = reinterpret_cast<const DirIndexHeader *>(data_);
+    auto offset = sizeof(DirIndexHeader);
+    dirs_ = {reinterpret_cast<const DirIndexDir *>(data_ + offset),
+             header_->dir_count};
+    offset += header_->dir_count * sizeof(DirIndexDir);
+    entries_ = {reinterpret_cast<const DirIndexEntry *>(data_ + offset),
+                header_->entry_count};
+    offset += header_->entry_count * sizeof(DirIndexEntry);
+    names_ = {reinterpret_cast<const char *>(data_ + offset),
+              header_->names_size};
+}
+
+DirIndex::~DirIndex() {
+    if (data_ != nullptr) {
+        munmap(data_, size_);
+    }
+}
+
+std::unique_ptr<DirIndex> DirIndex::Open(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    struct stat index_stat;
+    if (fstat(fd, &index_stat) == -1 ||
+        static_cast<size_t>(index_stat.st_size) < sizeof(DirIndexHeader)) {
+        close(fd);
+        return nullptr;
+    }
+    size_t size = index_stat.st_size;
+    auto data = static_cast<uint8_t *>(
+        mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
+    close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+
+    // the counts come from the file, so each is checked against what is
+    // left before anything is multiplied or added
+    auto header = reinterpret_cast<const DirIndexHeader *>(data);
+    auto left = size - sizeof(DirIndexHeader);
+    auto fits = [&left](uint64_t count, size_t element_size) {
+        if (count > left / element_size)
+            return false;
+        left -= count * element_size;
+        return true;
+    };
+    if (memcmp(header->magic, kDirIndexMagic, sizeof(kDirIndexMagic)) != 0 ||
+        header->version != kDirIndexVersion ||
+        !fits(header->dir_count, sizeof(DirIndexDir)) ||
+        !fits(header->entry_count, sizeof(DirIndexEntry)) ||
+        header->names_size != left) {
+        munmap(data, size);
+        return nullptr;
+    }
+
+    std::unique_ptr<DirIndex> index(new DirIndex(data, size));
+    for (auto &dir : index->dirs_) {
+        if (dir.first_entry > index->entries_.size() ||
+            dir.entry_count > index->entries_.size() - dir.first_entry)
+            return nullptr;
+    }
+    for (auto &entry : index->entries_) {
+        if (entry.name_offset > index->names_.size() ||
+            entry.name_length + entry.alias_length >
+                index->names_.size() - entry.name_offset)
+            return nullptr;
+    }
+    return index;
+}
+
+std::optional<std::span<const DirIndexEntry>>
+DirIndex::EntriesOf(uint32_t dir_first_cluster) const {
+    auto it = std::lower_bound(
+        dirs_.begin(), dirs_.end(), dir_first_cluster,
+        [](const DirIndexDir &dir, uint32_t cluster) {
+            return dir.first_cluster < cluster;
+        });
+    if (it == dirs_.end() || it->first_cluster != dir_first_cluster) {
+        return std::nullopt;
+    }
+    return entries_.subspan(it->first_entry, it->entry_count);
+}
+
+void DirIndexBuilder::AddDir(const DirTree &tree, NodeId dir) {
+    auto first_entry = entries_.size();
+    for (auto child = tree.FirstChild(dir); child != kNoNode;
+         child = tree.NextSibling(child)) {
+        auto &node = tree[child];
+        DirIndexEntry entry = {};
+        entry.first_cluster = node.first_cluster;
+        entry.size = node.size;
+        entry.name_offset = names_.size();
+        entry.first_slot = node.first_slot;
+        entry.slot_count = node.slot_count;
+        entry.name_length = node.name_length;
+        entry.attr = node.attr;
+        entry.alias_length = tree.AliasOf(child).size();
+        names_ += tree.NameOf(child);
+        names_ += tree.AliasOf(child);
+        entries_.push_back(entry);
+    }
+    dirs_.push_back({tree[dir].first_cluster,
+                     static_cast<uint32_t>(entries_.size() - first_entry),
+                     first_entry});
+}
+
+std::vector<uint32_t> DirIndexBuilder::DirClusters() {
+    std::sort(dirs_.begin(), dirs_.end(),
+              [](const DirIndexDir &a, const DirIndexDir &b) {
+                  return a.first_cluster < b.first_cluster;
+              });
+    std::vector<uint32_t> clusters;
+    for (auto &dir : dirs_) {
+        clusters.push_back(dir.first_cluster);
+    }
+    return clusters;
+}
+
+bool DirIndexBuilder::Write(const std::string &path, DirIndexHeader header) {
+    DirClusters();
+
+    memcpy(header.magic, kDirIndexMagic, sizeof(kDirIndexMagic));
+    header.version = kDirIndexVersion;
+    header.dir_count = dirs_.size();
+    header.entry_count = entries_.size();
+    header.names_size = names_.size();
+
+    // write next to the final path and rename, so readers never see half
+    auto tmp_path = path + ".tmp";
+    auto file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    auto ok =
+        fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(dirs_.data(), sizeof(DirIndexDir), dirs_.size(), file) ==
+            dirs_.size() &&
+        fwrite(entries_.data(), sizeof(DirIndexEntry), entries_.size(),
+               file) == entries_.size() &&
+        fwrite(names_.data(), 1, names_.size(), file) == names_.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace cs5250
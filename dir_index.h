@@ -0,0 +1,120 @@
+#pragma once
+
+#include "dir_tree.h"
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cs5250 {
+
+/*
+ * Sidecar directory index (<image>.fatidx)
+ *
+ * The file is a header followed by three packed arrays which are used in
+ * place after mmap:
+ *   dirs[]     one record per directory, sorted by first cluster
+ *   entries[]  children of every directory, grouped per directory
+ *   names[]    all child names, each followed by its 8.3 alias if any
+ *
+ * The index is only trusted when the hash of FAT #0 and of every directory
+ * cluster it describes still matches the image.
+ */
+struct DirIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t root_cluster;
+    uint64_t image_size;
+    uint64_t fat_hash;
+    uint64_t dir_hash;
+    uint64_t dir_count;
+    uint64_t entry_count;
+    uint64_t names_size;
+} __attribute__((packed));
+
+struct DirIndexDir {
+    uint32_t first_cluster;
+    uint32_t entry_count;
+    uint64_t first_entry;
+} __attribute__((packed));
+
+// mirrors DirTree::Node
+struct DirIndexEntry {
+    uint32_t first_cluster;
+    uint32_t size;
+    uint64_t name_offset;
+    uint32_t first_slot;
+    uint8_t slot_count;
+    uint8_t name_length;
+    uint8_t attr;
+    uint8_t alias_length;
+    uint8_t _[8];
+} __attribute__((packed));
+
+static_assert(sizeof(DirIndexHeader) == 64);
+static_assert(sizeof(DirIndexDir) == 16);
+static_assert(sizeof(DirIndexEntry) == 32);
+
+static inline constexpr char kDirIndexMagic[8] = {'F', 'A', 'T', 'I',
+                                                  'D', 'X', '\0', '\0'};
+static inline constexpr uint32_t kDirIndexVersion = 3;
+
+uint64_t HashBytes(const uint8_t *data, size_t size, uint64_t seed = 0);
+
+class DirIndex {
+  private:
+    uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    const DirIndexHeader *header_ = nullptr;
+    std::span<const DirIndexDir> dirs_;
+    std::span<const DirIndexEntry> entries_;
+    std::string_view names_;
+
+    DirIndex(uint8_t *data, size_t size);
+
+  public:
+    DirIndex(const DirIndex &) = delete;
+    DirIndex &operator=(const DirIndex &) = delete;
+    ~DirIndex();
+
+    // map the index at `path`, nullptr if it is missing or malformed
+    static std::unique_ptr<DirIndex> Open(const std::string &path);
+
+    const DirIndexHeader &Header() const { return *header_; }
+
+    std::span<const DirIndexDir> Dirs() const { return dirs_; }
+
+    std::optional<std::span<const DirIndexEntry>>
+    EntriesOf(uint32_t dir_first_cluster) const;
+
+    std::string_view NameOf(const DirIndexEntry &entry) const {
+        return names_.substr(entry.name_offset, entry.name_length);
+    }
+
+    std::string_view AliasOf(const DirIndexEntry &entry) const {
+        return names_.substr(entry.name_offset + entry.name_length,
+                             entry.alias_length);
+    }
+};
+
+class DirIndexBuilder {
+  private:
+    std::vector<DirIndexDir> dirs_;
+    std::vector<DirIndexEntry> entries_;
+    std::string names_;
+
+  public:
+    // records the children of `dir`, which must have been loaded
+    void AddDir(const DirTree &tree, NodeId dir);
+
+    // first clusters of the added directories, in the order they are stored
+    std::vector<uint32_t> DirClusters();
+
+    // header carries the image identity, counts are filled in here
+    bool Write(const std::string &path, DirIndexHeader header);
+};
+
+} // namespace cs5250
@@ -0,0 +1,209 @@
+#include "dir_tree.h"
+
+namespace cs5250 {
+
+size_t DirTree::BucketOf(NodeId parent, std::string_view name) const {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (auto c : name) {
+        h ^= static_cast<uint8_t>(FoldCase(c));
+        h *= 0x100000001b3ULL;
+    }
+    h ^= parent * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+    return h & (buckets_.size() - 1);
+}
+
+void DirTree::Rehash(size_t bucket_count) {
+    buckets_.assign(bucket_count, kNoNode);
+    alias_buckets_.assign(bucket_count, kNoNode);
+    // relink in id order so that earlier nodes stay first in their chain
+    std::vector<NodeId> tails(bucket_count, kNoNode);
+    for (NodeId id = 1; id < nodes_.size(); id++) {
+        if (nodes_[id].flags & kRemoved)
+            continue;
+        auto bucket = BucketOf(nodes_[id].parent, NameOf(id));
+        nodes_[id].hash_next = kNoNode;
+        if (tails[bucket] == kNoNode)
+            buckets_[bucket] = id;
+        else
+            nodes_[tails[bucket]].hash_next = id;
+        tails[bucket] = id;
+        LinkAlias(id);
+    }
+}
+
+// many files can share one 8.3 name, so aliases go in at the head of a
+// doubly linked chain and both linking and unlinking take constant time
+void DirTree::LinkAlias(NodeId id) {
+    auto &node = nodes_[id];
+    if (!(node.flags & kAliased))
+        return;
+    auto &head = alias_buckets_[BucketOf(node.parent, AliasOf(id))];
+    node.alias_prev = kNoNode;
+    node.alias_next = head;
+    if (head != kNoNode)
+        nodes_[head].alias_prev = id;
+    head = id;
+}
+
+void DirTree::LinkName(NodeId id) {
+    if (live_ > buckets_.size()) {
+        Rehash(buckets_.size() * 2);
+        return;
+    }
+    auto *next = &buckets_[BucketOf(nodes_[id].parent, NameOf(id))];
+    while (*next != kNoNode)
+        next = &nodes_[*next].hash_next;
+    *next = id;
+    LinkAlias(id);
+}
+
+void DirTree::UnlinkName(NodeId id) {
+    auto &node = nodes_[id];
+    auto *next = &buckets_[BucketOf(node.parent, NameOf(id))];
+    while (*next != id)
+        next = &nodes_[*next].hash_next;
+    *next = node.hash_next;
+
+    if (!(node.flags & kAliased))
+        return;
+    if (node.alias_prev == kNoNode)
+        alias_buckets_[BucketOf(node.parent, AliasOf(id))] = node.alias_next;
+    else
+        nodes_[node.alias_prev].alias_next = node.alias_next;
+    if (node.alias_next != kNoNode)
+        nodes_[node.alias_next].alias_prev = node.alias_prev;
+}
+
+void DirTree::Reset(uint32_t root_cluster) {
+    nodes_.clear();
+    names_.clear();
+    buckets_.assign(64, kNoNode);
+    alias_buckets_.assign(64, kNoNode);
+    live_ = 0;
+
+    Node root = {};
+    root.first_cluster = root_cluster;
+    root.parent = kNoNode;
+    root.first_child = kNoNode;
+    root.next_sibling = kNoNode;
+    root.prev_sibling = kNoNode;
+    root.hash_next = kNoNode;
+    root.alias_next = kNoNode;
+    root.alias_prev = kNoNode;
+    root.attr = kDirectoryAttr;
+    nodes_.push_back(root);
+}
+
+NodeId DirTree::Add(NodeId parent, std::string_view name,
+                    uint32_t first_cluster, uint32_t size, uint8_t attr,
+                    uint32_t first_slot, uint8_t slot_count,
+                    std::string_view alias) {
+    if (name.size() > 255)
+        name = name.substr(0, 255);
+    if (alias.size() > 255)
+        alias = alias.substr(0, 255);
+
+    NodeId id = nodes_.size();
+    Node node = {};
+    node.first_cluster = first_cluster;
+    node.size = size;
+    node.parent = parent;
+    node.first_child = kNoNode;
+    node.next_sibling = kNoNode;
+    node.hash_next = kNoNode;
+    node.alias_next = kNoNode;
+    node.alias_prev = kNoNode;
+    node.name_offset = names_.size();
+    node.first_slot = first_slot;
+    node.slot_count = slot_count;
+    node.name_length = name.size();
+    node.attr = attr;
+    names_.append(name);
+    if (!alias.empty()) {
+        node.flags |= kAliased;
+        names_.push_back(static_cast<char>(alias.size()));
+        names_.append(alias);
+    }
+
+    // children are kept in slot order, as a fresh read of the directory
+    // lists them; entries are read in that order, so only a node put in
+    // slots freed earlier has to look for its place
+    auto first = nodes_[parent].first_child;
+    if (first == kNoNode) {
+        nodes_[parent].first_child = id;
+        node.prev_sibling = id;
+    } else if (auto last = nodes_[first].prev_sibling;
+               nodes_[last].first_slot <= first_slot) {
+        nodes_[last].next_sibling = id;
+        nodes_[first].prev_sibling = id;
+        node.prev_sibling = last;
+    } else {
+        auto next = first;
+        while (nodes_[next].first_slot <= first_slot)
+            next = nodes_[next].next_sibling;
+        node.next_sibling = next;
+        node.prev_sibling = nodes_[next].prev_sibling;
+        if (next == first)
+            nodes_[parent].first_child = id;
+        else
+            nodes_[node.prev_sibling].next_sibling = id;
+        nodes_[next].prev_sibling = id;
+    }
+    nodes_.push_back(node);
+
+    live_++;
+    LinkName(id);
+    return id;
+}
+
+void DirTree::Remove(NodeId id) {
+    auto &node = nodes_[id];
+    auto &parent = nodes_[node.parent];
+    if (parent.first_child == id) {
+        parent.first_child = node.next_sibling;
+        if (node.next_sibling != kNoNode)
+            nodes_[node.next_sibling].prev_sibling = node.prev_sibling;
+    } else {
+        nodes_[node.prev_sibling].next_sibling = node.next_sibling;
+        if (node.next_sibling != kNoNode)
+            nodes_[node.next_sibling].prev_sibling = node.prev_sibling;
+        else
+            nodes_[parent.first_child].prev_sibling = node.prev_sibling;
+    }
+
+    std::vector<NodeId> pending = {id};
+    while (!pending.empty()) {
+        auto current = pending.back();
+        pending.pop_back();
+        for (auto child = nodes_[current].first_child; child != kNoNode;
+             child = nodes_[child].next_sibling)
+            pending.push_back(child);
+
+        UnlinkName(current);
+        nodes_[current].flags |= kRemoved;
+        live_--;
+    }
+}
+
+NodeId DirTree::Find(NodeId dir, std::string_view name) const {
+    for (auto id = buckets_[BucketOf(dir, name)]; id != kNoNode;
+         id = nodes_[id].hash_next) {
+        if (nodes_[id].parent == dir && NamesEqual(NameOf(id), name))
+            return id;
+    }
+
+    // an 8.3 name has at most 12 characters; the earliest match is the
+    // last one in its chain
+    auto found = kNoNode;
+    if (name.size() > 12)
+        return found;
+    for (auto id = alias_buckets_[BucketOf(dir, name)]; id != kNoNode;
+         id = nodes_[id].alias_next) {
+        if (nodes_[id].parent == dir && NamesEqual(AliasOf(id), name))
+            found = id;
+    }
+    return found;
+}
+
+} // namespace cs5250
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace cs5250 {
+
+// FAT compares short and long names without regard to case
+inline char FoldCase(char c) {
+    return c >= 'a' && c <= 'z' ? static_cast<char>(c - 'a' + 'A') : c;
+}
+
+inline bool NamesEqual(std::string_view a, std::string_view b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t i = 0; i < a.size(); i++) {
+        if (FoldCase(a[i]) != FoldCase(b[i]))
+            return false;
+    }
+    return true;
+}
+
+using NodeId = uint32_t;
+inline constexpr NodeId kNoNode = 0xFFFFFFFF;
+
+/*
+ * Directory tree as a flat node table
+ *
+ * Nodes are addressed by 32-bit ids and never move or get reused, so an id
+ * stays valid (if possibly removed) for the life of the tree. Children of
+ * a directory form a doubly linked list in the order of their slots,
+ * names live back to back in one arena, and one hash table keyed by
+ * (parent, case-folded name) serves the lookups of every directory. A
+ * node whose 8.3 name differs from its long name can also be found by it
+ * through a second table.
+ *
+ * Since ids are never reused, a removed node and its name stay in the table
+ * and the arena until Reset: a batch that keeps copying and removing files
+ * grows by one node and one name per file it ever wrote. That is a known
+ * limit; reusing ids would let a cached path lookup land on a new node.
+ */
+class DirTree {
+  public:
+    static constexpr NodeId kRoot = 0;
+
+    struct Node {
+        uint32_t first_cluster;
+        uint32_t size;
+        NodeId parent;
+        NodeId first_child;
+        NodeId next_sibling;
+        // the first child's points at the last child
+        NodeId prev_sibling;
+        // next node in the same hash bucket
+        NodeId hash_next;
+        // neighbours in the same alias bucket
+        NodeId alias_next;
+        NodeId alias_prev;
+        // the name, then for an aliased node the length of its 8.3 name in
+        // one byte and the 8.3 name itself
+        uint32_t name_offset;
+        // slots [first_slot, first_slot + slot_count) of the parent hold
+        // the long name entries followed by the short entry
+        uint32_t first_slot;
+        uint8_t slot_count;
+        uint8_t name_length;
+        uint8_t attr;
+        uint8_t flags;
+    };
+    static_assert(sizeof(Node) == 48);
+
+  private:
+    static constexpr uint8_t kLoaded = 1;
+    static constexpr uint8_t kRemoved = 2;
+    static constexpr uint8_t kAliased = 4;
+    static constexpr uint8_t kDirectoryAttr = 0x10;
+
+    std::vector<Node> nodes_;
+    std::string names_;
+    std::vector<NodeId> buckets_;
+    // same size as buckets_, keyed by (parent, case-folded 8.3 name); the
+    // node added last comes first
+    std::vector<NodeId> alias_buckets_;
+    size_t live_ = 0;
+
+    size_t BucketOf(NodeId parent, std::string_view name) const;
+
+    void Rehash(size_t bucket_count);
+
+    void LinkAlias(NodeId id);
+
+    void LinkName(NodeId id);
+
+    void UnlinkName(NodeId id);
+
+  public:
+    // an empty tree with only the root directory
+    void Reset(uint32_t root_cluster);
+
+    // adds a child to `parent` in slot order; names longer than 255 bytes
+    // are cut. `alias` is the 8.3 name if the child has a long name that
+    // differs from it, and empty otherwise
+    NodeId Add(NodeId parent, std::string_view name, uint32_t first_cluster,
+               uint32_t size, uint8_t attr, uint32_t first_slot,
+               uint8_t slot_count, std::string_view alias = {});
+
+    // unlinks `id` and everything below it
+    void Remove(NodeId id);
+
+    // the child of `dir` called `name` in any case, or failing that the
+    // one whose 8.3 name it is; kNoNode if none. When two children match
+    // the same way the first one added wins
+    NodeId Find(NodeId dir, std::string_view name) const;
+
+    const Node &operator[](NodeId id) const { return nodes_[id]; }
+
+    std::string_view NameOf(NodeId id) const {
+        return std::string_view(names_).substr(nodes_[id].name_offset,
+                                               nodes_[id].name_length);
+    }
+
+    // the 8.3 name given to Add, empty if there was none
+    std::string_view AliasOf(NodeId id) const {
+        if (!(nodes_[id].flags & kAliased))
+            return {};
+        auto offset = nodes_[id].name_offset + nodes_[id].name_length;
+        return std::string_view(names_).substr(
+            offset + 1, static_cast<uint8_t>(names_[offset]));
+    }
+
+    bool IsDir(NodeId id) const {
+        return (nodes_[id].attr & kDirectoryAttr) != 0;
+    }
+
+    bool IsAlive(NodeId id) const {
+        return id < nodes_.size() && !(nodes_[id].flags & kRemoved);
+    }
+
+    // whether the children of `dir` have been read
+    bool IsLoaded(NodeId dir) const { return nodes_[dir].flags & kLoaded; }
+
+    void SetLoaded(NodeId dir) { nodes_[dir].flags |= kLoaded; }
+
+    NodeId FirstChild(NodeId dir) const { return nodes_[dir].first_child; }
+
+    NodeId NextSibling(NodeId id) const { return nodes_[id].next_sibling; }
+
+    size_t NodeCount() const { return nodes_.size(); }
+};
+
+} // namespace cs5250
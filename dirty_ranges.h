@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace cs5250 {
+
+// [begin, end) byte offsets into the image
+using ByteRange = std::pair<uint64_t, uint64_t>;
+
+// Byte ranges of the mapped image written since they were last taken. A
+// write next to or inside the previous one extends it, so runs of entries
+// written in order stay a single range.
+class DirtyRanges {
+  private:
+    const uint8_t *base_ = nullptr;
+    std::vector<ByteRange> ranges_;
+    // the list is sorted and merged again once it doubles
+    size_t compact_at_ = 1024;
+
+    void Compact() {
+        std::sort(ranges_.begin(), ranges_.end());
+        size_t kept = 0;
+        for (auto &range : ranges_) {
+            if (kept > 0 && range.first <= ranges_[kept - 1].second) {
+                ranges_[kept - 1].second =
+                    std::max(ranges_[kept - 1].second, range.second);
+            } else {
+                ranges_[kept++] = range;
+            }
+        }
+        ranges_.resize(kept);
+        compact_at_ = std::max<size_t>(1024, kept * 2);
+    }
+
+  public:
+    DirtyRanges() = default;
+
+    explicit DirtyRanges(const uint8_t *base) : base_(base) {}
+
+    void Add(const void *address, size_t size) {
+        uint64_t begin = static_cast<const uint8_t *>(address) - base_;
+        uint64_t end = begin + size;
+        if (!ranges_.empty()) {
+            auto &last = ranges_.back();
+            if (begin >= last.first && begin <= last.second) {
+                last.second = std::max(last.second, end);
+                return;
+            }
+        }
+        ranges_.push_back({begin, end});
+        if (ranges_.size() >= compact_at_)
+            Compact();
+    }
+
+    bool Empty() const { return ranges_.empty(); }
+
+    // bytes covered, counting overlaps between ranges more than once
+    uint64_t Bytes() const {
+        uint64_t bytes = 0;
+        for (auto &range : ranges_)
+            bytes += range.second - range.first;
+        return bytes;
+    }
+
+    // the ranges sorted and merged; the set is empty afterwards
+    std::vector<ByteRange> Take() {
+        Compact();
+        compact_at_ = 1024;
+        return std::exchange(ranges_, {});
+    }
+};
+
+} // namespace cs5250
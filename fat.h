@@ -180,28 +180,10 @@ static_assert(sizeof(FATDirectory) == 32);
 
 static_assert(sizeof(FSInfo) == 512);
 
-struct SimpleStruct {
-    std::string name;
-    uint32_t first_cluster;
-    bool is_dir;
-    uint32_t size;
-    std::optional<std::vector<const LongNameDirectory *>> long_name_entries;
-
-    operator std::string() const { return name; }
-
-    bool operator==(const SimpleStruct &other) const {
-        return name == other.name && first_cluster == other.first_cluster &&
-               is_dir == other.is_dir;
-    }
+// `length` consecutive clusters starting at `start_cluster`
+struct Extent {
+    uint32_t start_cluster;
+    uint32_t length;
 };
 
 } // namespace cs5250
-
-// define hash for LsStruct
-namespace std {
-template <> struct hash<cs5250::SimpleStruct> {
-    std::size_t operator()(const cs5250::SimpleStruct &k) const {
-        return std::hash<uint32_t>{}(k.first_cluster);
-    }
-};
-} // namespace std
\ No newline at end of file
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace cs5250 {
+
+/*
+ * FAT entry codecs
+ *
+ * Each one reads and writes entry n of a FAT in place. The width is fixed
+ * once an image is opened, so everything that walks the FAT is compiled
+ * once per codec rather than checking the FAT type for every entry.
+ */
+
+// 12-bit entries, two packed in every three bytes
+struct FAT12Entry {
+    // values at or above this end a chain
+    static constexpr uint32_t kEndOfChain = 0xFF8;
+    // what a chain is ended with when it is written
+    static constexpr uint32_t kEndMark = 0xFFF;
+
+    // bytes a write of entry n touches, from OffsetOf(n) on
+    static constexpr size_t kBytes = 2;
+
+    static size_t CountOf(size_t fat_bytes) { return fat_bytes * 2 / 3; }
+
+    static size_t OffsetOf(uint32_t n) { return n + n / 2; }
+
+    static uint32_t Get(const uint8_t *fat, uint32_t n) {
+        auto p = fat + n + n / 2;
+        uint32_t value = p[0] | (p[1] << 8);
+        return n & 1 ? value >> 4 : value & 0xFFF;
+    }
+
+    static void Put(uint8_t *fat, uint32_t n, uint32_t value) {
+        auto p = fat + n + n / 2;
+        if (n & 1) {
+            p[0] = (p[0] & 0x0F) | ((value << 4) & 0xF0);
+            p[1] = (value >> 4) & 0xFF;
+        } else {
+            p[0] = value & 0xFF;
+            p[1] = (p[1] & 0xF0) | ((value >> 8) & 0x0F);
+        }
+    }
+};
+
+struct FAT16Entry {
+    static constexpr uint32_t kEndOfChain = 0xFFF8;
+    static constexpr uint32_t kEndMark = 0xFFFF;
+
+    static constexpr size_t kBytes = 2;
+
+    static size_t CountOf(size_t fat_bytes) { return fat_bytes / 2; }
+
+    static size_t OffsetOf(uint32_t n) { return size_t{n} * 2; }
+
+    static uint32_t Get(const uint8_t *fat, uint32_t n) {
+        uint16_t value;
+        memcpy(&value, fat + n * 2, sizeof(value));
+        return value;
+    }
+
+    static void Put(uint8_t *fat, uint32_t n, uint32_t value) {
+        uint16_t raw = value;
+        memcpy(fat + n * 2, &raw, sizeof(raw));
+    }
+};
+
+// 28 bits of a 32-bit entry; the top four bits are reserved and kept as
+// they are on writes
+struct FAT32Entry {
+    static constexpr uint32_t kMask = 0x0FFFFFFF;
+    static constexpr uint32_t kEndOfChain = 0x0FFFFFF8;
+    static constexpr uint32_t kEndMark = 0x0FFFFFFF;
+
+    static constexpr size_t kBytes = 4;
+
+    static size_t CountOf(size_t fat_bytes) { return fat_bytes / 4; }
+
+    static size_t OffsetOf(uint32_t n) { return size_t{n} * 4; }
+
+    static uint32_t Get(const uint8_t *fat, uint32_t n) {
+        uint32_t value;
+        memcpy(&value, fat + n * 4, sizeof(value));
+        return value & kMask;
+    }
+
+    static void Put(uint8_t *fat, uint32_t n, uint32_t value) {
+        uint32_t raw;
+        memcpy(&raw, fat + n * 4, sizeof(raw));
+        raw = (raw & ~kMask) | (value & kMask);
+        memcpy(fat + n * 4, &raw, sizeof(raw));
+    }
+};
+
+} // namespace cs5250
@@ -1,29 +1,21 @@
 #include "fat_manager.h"
+#include <atomic>
+#include <cerrno>
 #include <cstring>
-#include <deque>
-#include <fstream>
+#include <fnmatch.h>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace cs5250 {
 
-template <typename T> bool IsOneOfVector(T &input, const std::vector<T> &args) {
-    for (auto arg : args) {
-
-        if (reinterpret_cast<uint64_t>(input) ==
-            reinterpret_cast<uint64_t>(arg)) {
-            return true;
-        }
-    }
-    return false;
-}
-
 std::pair<std::string, bool>
 NameOfLongNameEntry(const LongNameDirectory &entry) {
     std::string ret = "";
@@ -45,26 +37,6 @@ NameOfLongNameEntry(const LongNameDirectory &entry) {
     return {ret, false};
 }
 
-static std::string ShortNameOf(const char name[11]) {
-    std::string ret = "";
-    for (auto i = 0; i < 8; ++i) {
-        if (name[i] == ' ') {
-            break;
-        }
-        ret = ret + name[i];
-    }
-    if (name[8] != ' ') {
-        ret = ret + ".";
-        for (auto i = 8; i < 11; ++i) {
-            if (name[i] == ' ') {
-                break;
-            }
-            ret = ret + name[i];
-        }
-    }
-    return ret;
-}
-
 void FATManager::Ck() { std::cout << Info() << std::endl; }
 
 void FATManager::InitBPB(const BPB &bpb) {
@@ -112,571 +84,1366 @@ void FATManager::InitBPB(const BPB &bpb) {
     reserved_sector_count_ = bpb.BPB_RsvdSecCnt;
     fat_sector_count_ = bpb.BPB_NumFATs * fat_size;
     this->root_dir_sector_count_ = root_dir_sector_count;
-    this->root_dir_ = SimpleStruct{"", this->root_cluster_number_, true, 0};
+    this->tree_.Reset(this->root_cluster_number_);
     this->data_sector_count_ = data_sector_count;
     this->number_of_fats_ = bpb.BPB_NumFATs;
-
-    if (fat_type_ != FATType::FAT32) {
-        return;
+    this->root_entry_count_ = bpb.BPB_RootEntCnt;
+    this->first_data_sector_ = bpb.BPB_RsvdSecCnt +
+                               bpb.BPB_NumFATs * fat_size +
+                               root_dir_sector_count;
+
+    geometry_.emplace(MakeGeometry(StartAddressOfSector(first_data_sector_),
+                                   BytesPerCluster()));
+
+    // FAT12 and FAT16 have no FSInfo sector
+    uint32_t next_free_hint = 2;
+    if (fat_type_ == FATType::FAT32) {
+        auto fs_info_sector_number = bpb.fat32.BPB_FSInfo;
+        this->fs_info_manager_ =
+            std::make_unique<FSInfoManager>(reinterpret_cast<uint8_t *>(
+                this->image_ + fs_info_sector_number * bytes_per_sector_));
+        next_free_hint = this->fs_info_manager_->GetNextFreeCluster();
     }
 
     // use all the FATs
-    std::vector<uint32_t *> fat_start_addresses;
+    std::vector<uint8_t *> fat_start_addresses;
     for (auto i = 0; i < bpb.BPB_NumFATs; ++i) {
-        fat_start_addresses.push_back(reinterpret_cast<uint32_t *>(
-            reinterpret_cast<uint64_t>(image_) +
-            (bpb.BPB_RsvdSecCnt * bytes_per_sector_) +
-            (i * fat_size * bytes_per_sector_)));
-    }
-    this->fat_map_ = std::make_unique<FATMap>(this->number_of_fats_,
-                                              this->sector_count_per_fat_ *
-                                                  bytes_per_sector_ / 4,
-                                              std::move(fat_start_addresses));
-
-    auto files_under_dir =
-        [this](const SimpleStruct &file,
-               const SimpleStruct &parent) -> std::vector<SimpleStruct> {
-        std::vector<SimpleStruct> ret;
-        auto seen_long_name = false;
-        std::string long_name = "";
-        std::vector<const LongNameDirectory *> long_name_dirs;
-
-        auto sector_function = [this, &ret, &seen_long_name, &long_name, &file,
-                                &parent,
-                                &long_name_dirs](auto sector_data_address) {
-            auto entry_parser = [&ret, &seen_long_name, &long_name, &file,
-                                 &parent,
-                                 &long_name_dirs](const FATDirectory *dir) {
-                if (dir->DIR_Attr == ToIntegral(FATDirectory::Attr::LongName)) {
-                    if (!seen_long_name) {
-                        seen_long_name = true;
-                        long_name = "";
-                    }
-                    const LongNameDirectory *long_dir =
-                        reinterpret_cast<const LongNameDirectory *>(dir);
-
-                    auto [name, end] = NameOfLongNameEntry(*long_dir);
-                    long_name = name + long_name;
-                    long_name_dirs.push_back(long_dir);
-                } else {
-                    std::string name;
-                    std::vector<const LongNameDirectory *> this_long_name_dirs;
-                    if (!seen_long_name) {
-                        name = ShortNameOf(
-                            reinterpret_cast<const char *>(dir->DIR_Name.name));
-                    } else {
-                        name = std::move(long_name);
-                        seen_long_name = false;
-                        this_long_name_dirs = std::move(long_name_dirs);
-                    }
-                    bool is_dir = false;
-
-                    if (dir->DIR_Attr ==
-                        ToIntegral(FATDirectory::Attr::Directory)) {
-                        is_dir = true;
-                    } else {
-                        is_dir = false;
-                    }
-                    uint32_t cluster =
-                        dir->DIR_FstClusLO | (dir->DIR_FstClusHI << 16);
-                    if (cluster == file.first_cluster ||
-                        cluster == parent.first_cluster || cluster == 0) {
-                    } else {
-                        if (this_long_name_dirs.size() > 0)
-                            ret.push_back({name, cluster, is_dir,
-                                           dir->DIR_FileSize,
-                                           std::move(this_long_name_dirs)});
-                        else
-                            ret.push_back(
-                                {name, cluster, is_dir, dir->DIR_FileSize});
-                    }
-                }
-            };
-            ForEveryDirEntryInDirSector(sector_data_address, entry_parser);
-        };
+        fat_start_addresses.push_back(image_ +
+                                      (bpb.BPB_RsvdSecCnt * bytes_per_sector_) +
+                                      (i * fat_size * bytes_per_sector_));
+    }
+    size_t fat_bytes = this->sector_count_per_fat_ * bytes_per_sector_;
+    auto cluster_end = MaximumValidClusterNumber() + 1;
+    switch (fat_type_) {
+    case FATType::FAT12:
+        fat_map_.emplace(std::in_place_type<FATMap<FAT12Entry>>,
+                         number_of_fats_, fat_bytes,
+                         std::move(fat_start_addresses), cluster_end,
+                         next_free_hint);
+        break;
+    case FATType::FAT16:
+        fat_map_.emplace(std::in_place_type<FATMap<FAT16Entry>>,
+                         number_of_fats_, fat_bytes,
+                         std::move(fat_start_addresses), cluster_end,
+                         next_free_hint);
+        break;
+    case FATType::FAT32:
+        fat_map_.emplace(std::in_place_type<FATMap<FAT32Entry>>,
+                         number_of_fats_, fat_bytes,
+                         std::move(fat_start_addresses), cluster_end,
+                         next_free_hint);
+        break;
+    }
+}
 
-        ForEverySectorOfFile(file, sector_function);
-        return ret;
+static inline uint32_t FirstClusterOf(const FATDirectory *entry) {
+    return entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
+}
+
+// the characters of one long name entry up to its terminator
+static size_t PartOfLongNameEntry(const LongNameDirectory &entry,
+                                  char (&part)[13]) {
+    size_t length = 0;
+    auto take = [&](const auto &name) {
+        for (auto &c : name.values) {
+            if (c.low == 0)
+                return false;
+            part[length++] = UnicodeToAscii(c.low | (c.high << 8));
+        }
+        return true;
     };
+    if (take(entry.LDIR_Name1) && take(entry.LDIR_Name2))
+        take(entry.LDIR_Name3);
+    return length;
+}
+
+static size_t ShortNameOf(const char name[11], char (&out)[12]) {
+    size_t length = 0;
+    for (auto i = 0; i < 8 && name[i] != ' '; ++i)
+        out[length++] = name[i];
+    if (name[8] != ' ') {
+        out[length++] = '.';
+        for (auto i = 8; i < 11 && name[i] != ' '; ++i)
+            out[length++] = name[i];
+    }
+    return length;
+}
+
+Generator<FATManager::DirEntryView>
+FATManager::EntriesOf(std::vector<Extent> extents) {
+    // the last part of a long name is stored first, so a name is put
+    // together from the back of the buffer
+    char long_name[20 * 13];
+    size_t long_name_start = sizeof(long_name);
+    uint32_t long_name_first_slot = 0;
+    uint32_t long_name_count = 0;
+    char short_name[12];
+    uint32_t slot = 0;
+
+    for (auto bytes : BytesOfExtents(extents)) {
+        auto entries = reinterpret_cast<const FATDirectory *>(bytes.data());
+        auto count = bytes.size() / sizeof(FATDirectory);
+        for (size_t i = 0; i < count; ++i, ++slot) {
+            auto entry = &entries[i];
+            if (IsFreeDirEntry(entry)) {
+                co_return;
+            }
+            if (IsDeletedDirEntry(entry)) {
+                // a long name belongs to the short entry right after it
+                long_name_count = 0;
+                continue;
+            }
 
-    std::deque<std::pair<SimpleStruct, SimpleStruct>> q;
-    q.push_back({root_dir_, root_dir_});
+            if (entry->DIR_Attr == ToIntegral(FATDirectory::Attr::LongName)) {
+                auto long_dir =
+                    reinterpret_cast<const LongNameDirectory *>(entry);
+                if ((long_dir->LDIR_Ord & 0x40) || long_name_count == 0 ||
+                    long_name_count == 20) {
+                    long_name_start = sizeof(long_name);
+                    long_name_first_slot = slot;
+                    long_name_count = 0;
+                }
+                char part[13];
+                auto length = PartOfLongNameEntry(*long_dir, part);
+                long_name_start -= length;
+                memcpy(long_name + long_name_start, part, length);
+                long_name_count++;
+                continue;
+            }
 
-    while (!q.empty()) {
-        auto cur = q.front();
-        q.pop_front();
+            auto part_count = long_name_count;
+            long_name_count = 0;
+            // "." and ".." point back at this directory and its parent
+            if (IsDotEntry(entry) ||
+                (entry->DIR_Attr & ToIntegral(FATDirectory::Attr::VolumeID))) {
+                continue;
+            }
 
-        if (cur.first.is_dir) {
-            auto sub_lists = files_under_dir(cur.first, cur.second);
-            for (auto &list : sub_lists) {
-                q.push_back({list, cur.first});
+            auto length = ShortNameOf(
+                reinterpret_cast<const char *>(entry->DIR_Name.name),
+                short_name);
+            auto short_view = std::string_view(short_name, length);
+            if (part_count > 0) {
+                auto name =
+                    std::string_view(long_name + long_name_start,
+                                     sizeof(long_name) - long_name_start);
+                co_yield DirEntryView{
+                    name,
+                    NamesEqual(name, short_view) ? std::string_view()
+                                                 : short_view,
+                    entry, long_name_first_slot,
+                    static_cast<uint8_t>(part_count + 1)};
+            } else {
+                co_yield DirEntryView{short_view, {}, entry, slot, 1};
             }
-            dir_map_[cur.first] = std::move(sub_lists);
         }
     }
-
-    auto fs_info_sector_number = bpb.fat32.BPB_FSInfo;
-    this->fs_info_manager_ =
-        std::make_unique<FSInfoManager>(reinterpret_cast<uint8_t *>(
-            this->image_ + fs_info_sector_number * bytes_per_sector_));
 }
 
-void FATManager::Ls() {
+void FATManager::ReadDir(NodeId dir) {
+    for (auto &entry : EntriesOf(ExtentsOf(dir))) {
+        tree_.Add(dir, entry.name, FirstClusterOf(entry.entry),
+                  entry.entry->DIR_FileSize, entry.entry->DIR_Attr,
+                  entry.first_slot, entry.slot_count, entry.alias);
+    }
+}
 
-    ASSERT(fat_type_ == FATType::FAT32);
+void FATManager::ReadDirFromIndex(NodeId dir,
+                                  std::span<const DirIndexEntry> entries) {
+    for (auto &entry : entries) {
+        tree_.Add(dir, dir_index_->NameOf(entry), entry.first_cluster,
+                  entry.size, entry.attr, entry.first_slot, entry.slot_count,
+                  dir_index_->AliasOf(entry));
+    }
+}
 
-    // recursively print the map
-    std::function<void(const SimpleStruct &, std::string prefix)> print_map =
-        [&](const SimpleStruct &cur, std::string prefix) {
-            if (dir_map_.find(cur) != dir_map_.end())
-                for (auto &sub : dir_map_[cur])
-                    print_map(sub, prefix + cur.name + "/");
-            else
-                std::cout << prefix << cur.name << std::endl;
-        };
+void FATManager::LoadChildren(NodeId dir) {
+    ASSERT(tree_.IsDir(dir));
+    if (tree_.IsLoaded(dir))
+        return;
 
-    print_map(root_dir_, "");
+    auto entries = dir_index_ ? dir_index_->EntriesOf(tree_[dir].first_cluster)
+                              : std::nullopt;
+    if (entries)
+        ReadDirFromIndex(dir, *entries);
+    else
+        ReadDir(dir);
+    tree_.SetLoaded(dir);
 }
 
-OptionalRef<SimpleStruct> FATManager::FindFile(const std::string &path) {
-    std::vector<cs5250::SimpleStruct> *current_dir = &dir_map_[root_dir_];
+void FATManager::LoadTree(NodeId root) {
+    // whatever is already read is kept; the sidecar index is cheaper to
+    // read than any scan
+    std::vector<NodeId> unread;
+    std::vector<NodeId> dirs = {root};
+    // every directory owns its first cluster, so meeting one twice, or
+    // one of an ancestor, means the tree loops back on itself; the repeat
+    // is left unread
+    std::unordered_set<uint32_t> seen;
+    for (auto node = tree_[root].parent; node != kNoNode;
+         node = tree_[node].parent)
+        seen.insert(tree_[node].first_cluster);
+    while (!dirs.empty()) {
+        auto dir = dirs.back();
+        dirs.pop_back();
+        if (!seen.insert(tree_[dir].first_cluster).second)
+            continue;
 
-    // split the path by '/'
-    std::vector<std::string> path_list;
-    std::string cur = "";
-    for (auto c : path) {
-        if (c == '/') {
-            if (cur != "") {
-                path_list.push_back(cur);
-                cur = "";
+        if (!tree_.IsLoaded(dir)) {
+            if (!UseDirIndexFor(root) && scan_threads_ > 1) {
+                unread.push_back(dir);
+                continue;
             }
-        } else {
-            cur = cur + c;
+            LoadChildren(dir);
+        }
+        for (auto child = tree_.FirstChild(dir); child != kNoNode;
+             child = tree_.NextSibling(child)) {
+            if (tree_.IsDir(child))
+                dirs.push_back(child);
         }
     }
-    if (cur != "") {
-        path_list.push_back(cur);
-    }
 
-    auto find_dir = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : *current_dir) {
-            if (dir.name == name && dir.is_dir) {
-                return dir;
+    if (!unread.empty())
+        ScanTree(unread);
+}
+
+namespace {
+
+// work item of a tree scan: a directory and its scan-wide number
+struct ScanTask {
+    uint32_t task;
+    uint32_t first_cluster;
+};
+
+constexpr uint32_t kNoTask = 0xFFFFFFFF;
+
+struct ScannedEntry {
+    // the name, then the alias
+    size_t name_offset;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint32_t first_slot;
+    // the task that reads this entry if it is a directory
+    uint32_t task;
+    uint8_t name_length;
+    uint8_t alias_length;
+    uint8_t slot_count;
+    uint8_t attr;
+};
+
+struct ScannedDir {
+    uint32_t task;
+    uint32_t entry_count;
+    size_t first_entry;
+};
+
+// what one worker decoded, merged into the tree once all are done
+struct ScanBuffer {
+    std::vector<ScannedDir> dirs;
+    std::vector<ScannedEntry> entries;
+    std::string names;
+};
+
+} // namespace
+
+void FATManager::ScanTree(const std::vector<NodeId> &roots) {
+    std::vector<ScanBuffer> buffers(scan_threads_);
+    std::vector<ScanTask> tasks;
+    // taken up front: the FAT12/16 root has no chain to follow
+    std::vector<std::vector<Extent>> root_extents;
+    for (uint32_t i = 0; i < roots.size(); i++) {
+        tasks.push_back({i, tree_[roots[i]].first_cluster});
+        root_extents.push_back(ExtentsOf(roots[i]));
+    }
+    std::atomic<uint32_t> next_task = roots.size();
+
+    RunWorkStealing(scan_threads_, tasks, [&](unsigned worker,
+                                              const ScanTask &task,
+                                              auto &&push) {
+        auto &buffer = buffers[worker];
+        ScannedDir dir = {task.task, 0, buffer.entries.size()};
+
+        auto extents = task.task < root_extents.size()
+                           ? root_extents[task.task]
+                           : ChainOf(task.first_cluster);
+        for (auto &[name_view, alias, entry, first_slot, slot_count] :
+             EntriesOf(std::move(extents))) {
+            auto name = name_view.substr(0, 255);
+            ScannedEntry scanned = {buffer.names.size(),
+                                    FirstClusterOf(entry),
+                                    entry->DIR_FileSize,
+                                    first_slot,
+                                    kNoTask,
+                                    static_cast<uint8_t>(name.size()),
+                                    static_cast<uint8_t>(alias.size()),
+                                    slot_count,
+                                    entry->DIR_Attr};
+            // every directory owns a cluster, so more tasks than clusters
+            // means the tree loops back on itself
+            if (entry->DIR_Attr & ToIntegral(FATDirectory::Attr::Directory)) {
+                auto child = next_task++;
+                if (child <= count_of_clusters_) {
+                    scanned.task = child;
+                    push(ScanTask{child, scanned.first_cluster});
+                }
             }
+            buffer.names.append(name);
+            buffer.names.append(alias);
+            buffer.entries.push_back(scanned);
         }
-        return std::nullopt;
-    };
 
-    auto find_file = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : *current_dir) {
-            if (dir.name == name && !dir.is_dir) {
-                return dir;
-            }
+        dir.entry_count = buffer.entries.size() - dir.first_entry;
+        buffer.dirs.push_back(dir);
+    });
+
+    // a directory's task is numbered before those of its subdirectories,
+    // so merging in task order always finds the parent node in place
+    auto task_count = next_task.load();
+    std::vector<std::pair<uint32_t, uint32_t>> where(task_count,
+                                                     {kNoTask, 0});
+    for (uint32_t w = 0; w < buffers.size(); w++) {
+        for (uint32_t i = 0; i < buffers[w].dirs.size(); i++)
+            where[buffers[w].dirs[i].task] = {w, i};
+    }
+    std::vector<NodeId> node_of_task(task_count, kNoNode);
+    for (uint32_t i = 0; i < roots.size(); i++)
+        node_of_task[i] = roots[i];
+
+    for (uint32_t task = 0; task < task_count; task++) {
+        auto [w, i] = where[task];
+        if (w == kNoTask)
+            continue;
+        auto &buffer = buffers[w];
+        auto &dir = buffer.dirs[i];
+        auto node = node_of_task[task];
+
+        for (size_t e = dir.first_entry; e < dir.first_entry + dir.entry_count;
+             e++) {
+            auto &entry = buffer.entries[e];
+            auto names = std::string_view(buffer.names);
+            auto id = tree_.Add(
+                node, names.substr(entry.name_offset, entry.name_length),
+                entry.first_cluster, entry.size, entry.attr, entry.first_slot,
+                entry.slot_count,
+                names.substr(entry.name_offset + entry.name_length,
+                             entry.alias_length));
+            if (entry.task != kNoTask)
+                node_of_task[entry.task] = id;
         }
-        return std::nullopt;
-    };
+        tree_.SetLoaded(node);
+    }
+}
 
-    for (auto &p : path_list) {
-        if (p == path_list.back()) {
-            auto file = find_file(p);
-            if (file) {
-                return file;
-            } else {
-                return std::nullopt;
-            }
-        } else {
-            auto dir = find_dir(p);
-            if (dir) {
-                current_dir = &dir_map_[*dir];
-            } else {
+std::optional<DirIndexHeader>
+FATManager::IdentityOfImage(const std::vector<uint32_t> &dir_clusters) {
+    DirIndexHeader identity = {};
+    identity.root_cluster = root_cluster_number_;
+    identity.image_size = image_size_;
+    identity.fat_hash =
+        HashBytes(image_ + reserved_sector_count_ * bytes_per_sector_,
+                  sector_count_per_fat_ * bytes_per_sector_);
+
+    uint64_t dir_hash = 0;
+    for (auto cluster_number : dir_clusters) {
+        // a stale index may name clusters that are no longer directories
+        if (cluster_number < 2 || cluster_number > MaximumValidClusterNumber())
+            return std::nullopt;
+        auto extents = ChainOf(cluster_number);
+        for (auto &extent : extents) {
+            if (extent.start_cluster < 2 ||
+                extent.start_cluster + extent.length - 1 >
+                    MaximumValidClusterNumber())
                 return std::nullopt;
-            }
         }
+        for (auto bytes : BytesOfExtents(extents))
+            dir_hash = HashBytes(bytes.data(), bytes.size(), dir_hash);
     }
+    identity.dir_hash = dir_hash;
+    return identity;
+}
+
+void FATManager::LoadDirIndex() {
+    dir_index_checked_ = true;
+    if (fat_type_ != FATType::FAT32)
+        return;
+
+    auto index = DirIndex::Open(IndexPath());
+    if (!index)
+        return;
 
-    return std::nullopt;
+    std::vector<uint32_t> dir_clusters;
+    for (auto &dir : index->Dirs())
+        dir_clusters.push_back(dir.first_cluster);
+
+    auto identity = IdentityOfImage(dir_clusters);
+    auto &header = index->Header();
+    if (identity && header.root_cluster == identity->root_cluster &&
+        header.image_size == identity->image_size &&
+        header.fat_hash == identity->fat_hash &&
+        header.dir_hash == identity->dir_hash) {
+        dir_index_ = std::move(index);
+    }
 }
 
-OptionalRef<SimpleStruct> FATManager::FindParentDir(const std::string &path) {
+void FATManager::Index() {
+    // the index is keyed by first cluster, which the FAT12/16 root lacks
+    if (fat_type_ != FATType::FAT32) {
+        throw FATError("index needs a FAT32 volume");
+    }
 
-    auto current_dir = &root_dir_;
+    LoadTree();
 
-    // split the path by '/'
-    std::vector<std::string> path_list;
-    std::string cur = "";
-    for (auto c : path) {
-        if (c == '/') {
-            if (cur != "") {
-                path_list.push_back(cur);
-                cur = "";
-            }
-        } else {
-            cur = cur + c;
+    DirIndexBuilder builder;
+    std::vector<NodeId> dirs = {DirTree::kRoot};
+    // a directory met again through a loop is indexed once
+    std::unordered_set<uint32_t> seen;
+    while (!dirs.empty()) {
+        auto dir = dirs.back();
+        dirs.pop_back();
+        if (!seen.insert(tree_[dir].first_cluster).second)
+            continue;
+
+        LoadChildren(dir);
+        builder.AddDir(tree_, dir);
+        for (auto child = tree_.FirstChild(dir); child != kNoNode;
+             child = tree_.NextSibling(child)) {
+            if (tree_.IsDir(child))
+                dirs.push_back(child);
         }
     }
-    if (cur != "") {
-        path_list.push_back(cur);
+
+    auto identity = IdentityOfImage(builder.DirClusters());
+    if (!identity || !builder.Write(IndexPath(), identity.value())) {
+        throw FATError("failed to write index " + IndexPath());
+    }
+}
+
+void FATManager::OpenJournal() {
+    journal_ = Journal::Open(JournalPath(), image_fd_, image_);
+    if (!journal_) {
+        throw FATError("failed to open journal " + JournalPath());
     }
+    TrackWrites();
+    WithFATMap([](auto &fat_map) { fat_map.HoldFrees(true); });
+}
 
-    auto find_dir = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : dir_map_[*current_dir]) {
-            // std::cout << dir.name << std::endl;
-            if (dir.name == name && dir.is_dir) {
-                return dir;
-            }
-        }
-        return std::nullopt;
-    };
+void FATManager::SetSyncMode(SyncMode mode) {
+    sync_mode_ = mode;
+    if (mode != SyncMode::None)
+        TrackWrites();
+}
 
-    for (auto &p : path_list) {
-        if (p == path_list.back()) {
-            return *current_dir;
-        } else {
-            auto dir = find_dir(p);
-            if (dir) {
-                current_dir = &(dir->get());
-            } else {
-                return std::nullopt;
-            }
+void FATManager::SetMirrorSync(bool sync) {
+    WithFATMap([&](auto &fat_map) { fat_map.SetMirrorSync(sync); });
+}
+
+void FATManager::TrackWrites() {
+    if (track_writes_)
+        return;
+    track_writes_ = true;
+    data_dirty_ = DirtyRanges(image_);
+    metadata_dirty_ = DirtyRanges(image_);
+    WithFATMap([&](auto &fat_map) { fat_map.TrackWrites(&metadata_dirty_); });
+    if (fs_info_manager_)
+        fs_info_manager_->TrackWrites(&metadata_dirty_);
+}
+
+// the pages under `range`: those it touches, or with `whole_pages` only
+// those it covers, clamped to the mapping
+static ByteRange PagesOf(ByteRange range, uint64_t image_size,
+                         bool whole_pages) {
+    uint64_t page_mask = sysconf(_SC_PAGESIZE) - 1;
+    auto [begin, end] = range;
+    if (whole_pages) {
+        begin = (begin + page_mask) & ~page_mask;
+        end &= ~page_mask;
+    } else {
+        begin &= ~page_mask;
+        end = std::min((end + page_mask) & ~page_mask,
+                       (image_size + page_mask) & ~page_mask);
+    }
+    return {begin, std::max(begin, end)};
+}
+
+void FATManager::Commit() {
+    WithFATMap([](auto &fat_map) { fat_map.SyncMirrors(); });
+    if (data_dirty_.Empty() && metadata_dirty_.Empty())
+        return;
+
+    auto data = data_dirty_.Take();
+    auto metadata = metadata_dirty_.Take();
+    if (!journal_) {
+        // file data first, so no synced entry points at unwritten clusters
+        SyncRanges(data);
+        SyncRanges(metadata);
+        return;
+    }
+
+    if (!journal_->Commit(data, metadata)) {
+        throw FATError(std::string("journal commit: ") + strerror(errno));
+    }
+    // the file now matches the mapping, so the private copies can go, and
+    // the clusters freed in this transaction can be handed out again
+    DropPages(data, false);
+    DropPages(metadata, false);
+    WithFATMap([](auto &fat_map) { fat_map.ReleaseFrees(); });
+}
+
+void FATManager::EndOperation() {
+    if (sync_mode_ == SyncMode::Op ||
+        (journal_ && metadata_dirty_.Bytes() >= kGroupCommitBytes))
+        Commit();
+}
+
+void FATManager::SyncRanges(const std::vector<ByteRange> &ranges) {
+    for (auto range : ranges) {
+        auto [begin, end] = PagesOf(range, image_size_, false);
+        if (begin < end && msync(image_ + begin, end - begin, MS_SYNC) != 0) {
+            throw FATError(std::string("msync: ") + strerror(errno));
         }
     }
+}
 
-    return std::nullopt;
+void FATManager::FlushDataIfLarge() {
+    if (!journal_ || data_dirty_.Bytes() < kDataFlushBytes)
+        return;
+
+    // file data lives in clusters no committed metadata points at yet, so
+    // it can go to the file ahead of the commit
+    auto data = data_dirty_.Take();
+    if (!journal_->WriteData(data)) {
+        throw FATError(std::string("journal data write: ") + strerror(errno));
+    }
+    DropPages(data, true);
 }
 
-std::optional<std::vector<std::reference_wrapper<SimpleStruct>>>
-FATManager::FindFileWithDirs(const std::string &path) {
-    auto current_dir = &dir_map_[root_dir_];
+void FATManager::DropPages(const std::vector<ByteRange> &ranges,
+                           bool whole_pages) {
+    for (auto range : ranges) {
+        auto [begin, end] = PagesOf(range, image_size_, whole_pages);
+        if (begin < end)
+            madvise(image_ + begin, end - begin, MADV_DONTNEED);
+    }
+}
 
-    // split the path by '/'
-    std::vector<std::string> path_list;
-    std::string cur = "";
-    for (auto c : path) {
-        if (c == '/') {
-            if (cur != "") {
-                path_list.push_back(cur);
-                cur = "";
-            }
+std::vector<Extent> FATManager::ChainOf(uint32_t first_cluster) {
+    std::vector<Extent> extents;
+    ForEveryExtentOfChain(first_cluster, [&extents](const Extent &extent) {
+        extents.push_back(extent);
+    });
+    return extents;
+}
+
+const std::vector<Extent> &FATManager::ExtentsOf(NodeId file) {
+    if (auto it = extents_.find(file); it != extents_.end())
+        return it->second;
+    if (file == DirTree::kRoot && fat_type_ != FATType::FAT32)
+        return extents_[file] = {{0, 0}};
+    return extents_[file] = ChainOf(tree_[file].first_cluster);
+}
+
+namespace {
+
+// collects output lines and hands them to stdout in large writes
+class OutputBuffer {
+  private:
+    static constexpr size_t kCapacity = 1 << 20;
+    std::string buffer_;
+
+  public:
+    OutputBuffer() { buffer_.reserve(kCapacity); }
+
+    ~OutputBuffer() { Flush(); }
+
+    void Append(std::string_view data) {
+        if (buffer_.size() + data.size() > kCapacity)
+            Flush();
+        buffer_.append(data);
+    }
+
+    void Flush() {
+        fwrite(buffer_.data(), 1, buffer_.size(), stdout);
+        buffer_.clear();
+    }
+};
+
+} // namespace
+
+std::string FATManager::PathOf(NodeId node) {
+    std::vector<NodeId> chain;
+    for (; node != DirTree::kRoot; node = tree_[node].parent)
+        chain.push_back(node);
+
+    std::string path;
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        path += '/';
+        path += tree_.NameOf(*it);
+    }
+    return path;
+}
+
+static void AppendJsonString(std::string &out, std::string_view value) {
+    out += '"';
+    for (auto c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<uint8_t>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out += escaped;
         } else {
-            cur = cur + c;
+            out += c;
         }
     }
-    if (cur != "") {
-        path_list.push_back(cur);
+    out += '"';
+}
+
+void FATManager::Ls(const std::string &path, std::optional<uint32_t> max_depth,
+                    LsFormat format) {
+    auto start = ResolveDir(path);
+    if (start == kNoNode)
+        start = Resolve(path);
+    if (start == kNoNode) {
+        throw FATError("file " + path + " not found");
     }
 
-    auto find = [&](std::string name) -> OptionalRef<SimpleStruct> {
-        for (auto &dir : *current_dir) {
-            if (dir.name == name) {
-                return dir;
-            }
+    OutputBuffer out;
+    // the path of the entry being listed, without a trailing slash
+    auto line = PathOf(start);
+    std::string json;
+    std::string names;
+    uint64_t record_count = 0;
+
+    auto emit = [&](uint32_t first_cluster, uint32_t size, uint8_t attr) {
+        bool is_dir = attr & ToIntegral(FATDirectory::Attr::Directory);
+        if (format == LsFormat::Text) {
+            out.Append(line);
+            out.Append(is_dir ? "/\n" : "\n");
+            return;
+        }
+
+        uint32_t cluster_count = 0;
+        uint32_t extent_count = 0;
+        ForEveryExtentOfChain(first_cluster, [&](const Extent &extent) {
+            cluster_count += extent.length;
+            extent_count++;
+        });
+
+        if (format == LsFormat::NDJson) {
+            json = "{\"path\":";
+            AppendJsonString(json, line);
+            json += ",\"size\":" + std::to_string(size);
+            json += ",\"first_cluster\":" + std::to_string(first_cluster);
+            json += is_dir ? ",\"dir\":true" : ",\"dir\":false";
+            json += ",\"attr\":" + std::to_string(attr);
+            json += ",\"clusters\":" + std::to_string(cluster_count);
+            json += ",\"extents\":" + std::to_string(extent_count) + "}\n";
+            out.Append(json);
+            return;
         }
-        return std::nullopt;
+
+        LsRecord record = {};
+        record.path_offset = names.size();
+        record.path_length = line.size();
+        record.size = size;
+        record.first_cluster = first_cluster;
+        record.cluster_count = cluster_count;
+        record.extent_count = extent_count;
+        record.is_dir = is_dir;
+        record.attr = attr;
+        names += line;
+        record_count++;
+        out.Append({reinterpret_cast<const char *>(&record), sizeof(record)});
     };
 
-    std::vector<std::reference_wrapper<SimpleStruct>> ret;
-    for (auto &p : path_list) {
-        if (auto file = find(p); file) {
-            ret.push_back(*file);
-            if (p == path_list.back()) {
-                return ret;
-            } else if (file->get().is_dir) {
-                current_dir = &(dir_map_[*file]);
+    if (!tree_.IsDir(start)) {
+        auto &node = tree_[start];
+        emit(node.first_cluster, node.size, node.attr);
+    } else {
+        // the whole tree is worth reading up front when the pool can
+        if (!max_depth && scan_threads_ > 1)
+            LoadTree(start);
+        // checking the index hashes all of FAT #0 and every directory in
+        // it, which only a full listing makes up for; otherwise the
+        // directories not in the tree are decoded as they are listed
+        auto whole_tree = !max_depth && start == DirTree::kRoot;
+
+        struct Frame {
+            // the next child of a directory that is in the tree...
+            NodeId next;
+            // ...or the entries of one that is not, decoded as they are
+            // listed and never kept
+            std::optional<Generator<DirEntryView>> entries;
+            Generator<DirEntryView>::Iterator entry;
+            size_t path_length;
+            uint32_t depth;
+        };
+        std::vector<Frame> stack;
+        auto push = [&](NodeId node, uint32_t first_cluster, uint32_t depth) {
+            Frame frame = {kNoNode, std::nullopt, {}, line.size(), depth};
+            if (node != kNoNode &&
+                (tree_.IsLoaded(node) || dir_index_ ||
+                 (whole_tree && HaveDirIndex()))) {
+                LoadChildren(node);
+                frame.next = tree_.FirstChild(node);
             } else {
-                return std::nullopt;
+                frame.entries = EntriesOf(node != kNoNode
+                                              ? ExtentsOf(node)
+                                              : ChainOf(first_cluster));
+                frame.entry = frame.entries->begin();
             }
-        } else {
-            return std::nullopt;
+            stack.push_back(std::move(frame));
+        };
+        push(start, tree_[start].first_cluster, 1);
+
+        // depth first, reusing one path buffer: each frame remembers where
+        // its directory's path ends
+        while (!stack.empty()) {
+            auto &frame = stack.back();
+            auto node = kNoNode;
+            uint32_t first_cluster, size;
+            uint8_t attr;
+            line.resize(frame.path_length);
+            line += '/';
+
+            if (frame.entries) {
+                if (frame.entry == std::default_sentinel) {
+                    stack.pop_back();
+                    continue;
+                }
+                line += frame.entry->name.substr(0, 255);
+                first_cluster = FirstClusterOf(frame.entry->entry);
+                size = frame.entry->entry->DIR_FileSize;
+                attr = frame.entry->entry->DIR_Attr;
+                ++frame.entry;
+            } else {
+                if (frame.next == kNoNode) {
+                    stack.pop_back();
+                    continue;
+                }
+                node = frame.next;
+                frame.next = tree_.NextSibling(node);
+                line += tree_.NameOf(node);
+                first_cluster = tree_[node].first_cluster;
+                size = tree_[node].size;
+                attr = tree_[node].attr;
+            }
+            auto depth = frame.depth;
+            emit(first_cluster, size, attr);
+
+            // a directory deeper than the volume has clusters loops back
+            if ((attr & ToIntegral(FATDirectory::Attr::Directory)) &&
+                (!max_depth || depth < *max_depth) &&
+                depth <= count_of_clusters_)
+                push(node, first_cluster, depth + 1);
         }
     }
-    return std::nullopt;
-}
 
-void FATManager::CopyFileTo(const std::string &path, const std::string &dest) {
-    auto file_op = FindFile(path);
-    if (!file_op) {
-        std::cerr << "file " << path << " not found" << std::endl;
-        std::exit(1);
+    if (format == LsFormat::Binary) {
+        LsTrailer trailer = {};
+        memcpy(trailer.magic, kLsMagic, sizeof(kLsMagic));
+        trailer.version = kLsVersion;
+        trailer.record_size = sizeof(LsRecord);
+        trailer.record_count = record_count;
+        trailer.names_size = names.size();
+        out.Append(names);
+        out.Append({reinterpret_cast<const char *>(&trailer), sizeof(trailer)});
     }
+}
 
-    // open a file for creating or writing
-    auto file_ptr = std::make_unique<std::ofstream>(dest, std::ios::binary);
-    if (!file_ptr->is_open()) {
-        std::cerr << "failed to open file " << dest << std::endl;
-        std::exit(1);
-    }
+// splits "/a/b/c/" into "/a/b" and "c"
+static std::pair<std::string_view, std::string_view>
+SplitPath(std::string_view path) {
+    while (!path.empty() && path.back() == '/')
+        path.remove_suffix(1);
+    auto pos = path.find_last_of('/');
+    if (pos == std::string_view::npos)
+        return {{}, path};
+    return {path.substr(0, pos), path.substr(pos + 1)};
+}
+
+NodeId FATManager::FindChild(NodeId dir, std::string_view name) {
+    LoadChildren(dir);
+    return tree_.Find(dir, name);
+}
 
-    auto &&file = file_op.value().get();
-    auto left_size = file.size;
+NodeId FATManager::ResolveDir(std::string_view path) {
+    while (!path.empty() && path.back() == '/')
+        path.remove_suffix(1);
+    if (path.empty())
+        return DirTree::kRoot;
+    if (auto hit = dentry_cache_.Find(path); hit && tree_.IsAlive(*hit))
+        return tree_.IsDir(*hit) ? *hit : kNoNode;
+
+    // a miss resolves, and caches, the parent prefix first
+    auto [parent_path, name] = SplitPath(path);
+    auto parent = ResolveDir(parent_path);
+    if (parent == kNoNode)
+        return kNoNode;
+    auto dir = FindChild(parent, name);
+    if (dir == kNoNode || !tree_.IsDir(dir))
+        return kNoNode;
+    dentry_cache_.Insert(path, dir);
+    return dir;
+}
 
-    ForEverySectorOfFile(
-        file, [this, &file_ptr, &left_size](const uint8_t *data) {
-            if (left_size == 0) {
-                return;
+NodeId FATManager::Resolve(std::string_view path) {
+    auto [parent_path, name] = SplitPath(path);
+    if (name.empty())
+        return kNoNode;
+    if (auto hit = dentry_cache_.Find(path); hit && tree_.IsAlive(*hit))
+        return *hit;
+
+    auto parent = ResolveDir(parent_path);
+    if (parent == kNoNode)
+        return kNoNode;
+    auto file = FindChild(parent, name);
+    if (file != kNoNode)
+        dentry_cache_.Insert(path, file);
+    return file;
+}
+
+NodeId FATManager::FindFile(const std::string &path) {
+    auto file = Resolve(path);
+    if (file == kNoNode || tree_.IsDir(file))
+        return kNoNode;
+    return file;
+}
+
+NodeId FATManager::FindParentDir(const std::string &path) {
+    auto [parent_path, name] = SplitPath(path);
+    if (name.empty())
+        return kNoNode;
+    return ResolveDir(parent_path);
+}
+
+enum class CopyMethod { CopyFileRange, SendFile, Write };
+
+// Copies `size` bytes at `offset` of the image to out_fd. The kernel moves
+// the data with copy_file_range, or sendfile for pipes and sockets; when
+// neither works for this pair of files it is written from the mapping.
+static bool CopyOut(CopyMethod &method, int image_fd, off_t offset,
+                    int out_fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t copied = -1;
+        switch (method) {
+        case CopyMethod::CopyFileRange: {
+            loff_t in_offset = offset;
+            copied =
+                copy_file_range(image_fd, &in_offset, out_fd, NULL, size, 0);
+            break;
+        }
+        case CopyMethod::SendFile: {
+            off_t in_offset = offset;
+            copied = sendfile(out_fd, image_fd, &in_offset, size);
+            break;
+        }
+        case CopyMethod::Write:
+            copied = write(out_fd, data, size);
+            break;
+        }
+
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0 && method != CopyMethod::Write) {
+            if (copied < 0 && !IsOneOf(errno, EXDEV, EINVAL, ENOSYS,
+                                       EOPNOTSUPP, EBADF, ESPIPE)) {
+                return false;
             }
-            // write the data to the file
-            auto copy_size = left_size < this->bytes_per_sector_
-                                 ? left_size
-                                 : this->bytes_per_sector_;
-            file_ptr->write(reinterpret_cast<const char *>(data), copy_size);
-            left_size -= copy_size;
-        });
+            method = method == CopyMethod::CopyFileRange ? CopyMethod::SendFile
+                                                         : CopyMethod::Write;
+            continue;
+        }
+        if (copied <= 0) {
+            return false;
+        }
+        offset += copied;
+        data += copied;
+        size -= copied;
+    }
+    return true;
 }
 
-void FATManager::Delete(const std::string &path) {
-    auto detailed_file_option = FindFileWithDirs(path);
-    if (!detailed_file_option) {
-        std::cerr << "file " << path << " not found" << std::endl;
-        std::exit(1);
+void FATManager::CopyFileTo(const std::string &path, const std::string &dest) {
+    auto file = FindFile(path);
+    if (file == kNoNode) {
+        throw FATError("file " + path + " not found");
     }
 
-    auto &detailed_file = detailed_file_option.value();
-    auto file = detailed_file.back().get();
-    auto is_dir = file.is_dir;
+    // open a file for creating or writing
+    auto to_stdout = dest == "-";
+    auto out_fd = to_stdout ? STDOUT_FILENO
+                            : open(dest.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                                   0644);
+    if (out_fd < 0) {
+        throw FATError("failed to open file " + dest);
+    }
+    // earlier output of a batch is still in the stdio buffer
+    if (to_stdout) {
+        fflush(stdout);
+    }
 
-    if (is_dir) {
-        DeleteSingleDir(file);
-    } else {
-        DeleteSingleFile(file);
+    uint64_t left_size = tree_[file].size;
+    // staged file data is only in the private mapping
+    auto method = journal_ && !data_dirty_.Empty() ? CopyMethod::Write
+                                                   : CopyMethod::CopyFileRange;
+
+    // one kernel call per run of consecutive clusters
+    for (auto bytes : BytesOfExtents(ExtentsOf(file))) {
+        if (left_size == 0) {
+            break;
+        }
+        auto copy_size = std::min<uint64_t>(left_size, bytes.size());
+        if (!CopyOut(method, image_fd_, bytes.data() - image_, out_fd,
+                     bytes.data(), copy_size)) {
+            if (!to_stdout)
+                close(out_fd);
+            throw FATError("failed to write file " + dest);
+        }
+        left_size -= copy_size;
     }
 
-    auto is_under_root = detailed_file.size() == 1;
-    if (is_under_root) {
-        RemoveEntryInDir(root_dir_, file);
-    } else {
-        auto parent = detailed_file.at(detailed_file.size() - 2).get();
-        RemoveEntryInDir(parent, file);
+    if (!to_stdout) {
+        close(out_fd);
     }
 }
 
-#define UNIMPLEMENTED()                                                        \
-    {                                                                          \
-        std::cerr << "unimplemented" << std::endl;                             \
-        std::exit(1);                                                          \
+void FATManager::Delete(const std::vector<std::string> &paths) {
+    // nothing is deleted unless every path resolves
+    std::vector<NodeId> targets;
+    for (auto &path : paths) {
+        if (path.find_first_of("*?[") == std::string::npos) {
+            auto file = Resolve(path);
+            if (file == kNoNode) {
+                throw FATError("file " + path + " not found");
+            }
+            targets.push_back(file);
+            continue;
+        }
+        auto matches = Glob(path);
+        if (matches.empty()) {
+            throw FATError("no file matches " + path);
+        }
+        targets.insert(targets.end(), matches.begin(), matches.end());
     }
 
-void FATManager::DeleteSingleDir(const SimpleStruct &dir) {
-    auto inner_files = dir_map_[dir];
-    for (auto &file : inner_files) {
-        if (file.is_dir) {
-            DeleteSingleDir(file);
-        } else {
-            DeleteSingleFile(file);
+    DeleteNodes(std::move(targets));
+    EndOperation();
+}
+
+std::vector<NodeId> FATManager::Glob(std::string_view pattern) {
+    std::vector<NodeId> matches = {DirTree::kRoot};
+    while (!pattern.empty()) {
+        auto slash = pattern.find('/');
+        auto component = pattern.substr(0, slash);
+        pattern.remove_prefix(slash == std::string_view::npos ? pattern.size()
+                                                              : slash + 1);
+        if (component.empty())
+            continue;
+
+        std::vector<NodeId> next;
+        auto wildcard = component.find_first_of("*?[") != std::string::npos;
+        auto wanted = std::string(component);
+        for (auto dir : matches) {
+            if (!tree_.IsDir(dir))
+                continue;
+            if (!wildcard) {
+                if (auto child = FindChild(dir, component); child != kNoNode)
+                    next.push_back(child);
+                continue;
+            }
+            LoadChildren(dir);
+            for (auto child = tree_.FirstChild(dir); child != kNoNode;
+                 child = tree_.NextSibling(child)) {
+                auto name = std::string(tree_.NameOf(child));
+                if (fnmatch(wanted.c_str(), name.c_str(), FNM_CASEFOLD) == 0)
+                    next.push_back(child);
+            }
         }
+        matches = std::move(next);
     }
-    DeleteSingleFile(dir);
+    std::erase(matches, DirTree::kRoot);
+    return matches;
 }
 
-void FATManager::DeleteSingleFile(const SimpleStruct &file) {
-    auto cluster_entries = ClustersOfFile(file);
+void FATManager::DeleteNodes(std::vector<NodeId> targets) {
+    // a target below another one goes with it
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    std::erase_if(targets, [&](NodeId target) {
+        for (auto node = tree_[target].parent; node != DirTree::kRoot;
+             node = tree_[node].parent) {
+            if (std::binary_search(targets.begin(), targets.end(), node))
+                return true;
+        }
+        return false;
+    });
 
-    for (auto cluster : cluster_entries) {
-        this->fat_map_->SetFree(cluster);
-        this->IncreaseFreeClusterCount(1);
+    for (auto target : targets) {
+        if (tree_.IsDir(target))
+            LoadTree(target);
     }
-}
 
-void FATManager::RemoveEntryInDir(const SimpleStruct &dir,
-                                  const SimpleStruct &file) {
+    // straight from the FAT: each run is taken after its link was read
+    std::vector<uint32_t> clusters;
+    std::vector<NodeId> pending = targets;
+    WithFATMap([&](auto &fat_map) {
+        while (!pending.empty()) {
+            auto node = pending.back();
+            pending.pop_back();
+            for (auto &extent : fat_map.Chain(tree_[node].first_cluster,
+                                              count_of_clusters_)) {
+                for (decltype(extent.length) i = 0; i < extent.length; i++)
+                    clusters.push_back(extent.start_cluster + i);
+            }
+            extents_.erase(node);
+            free_slots_.erase(node);
+            for (auto child = tree_.FirstChild(node); child != kNoNode;
+                 child = tree_.NextSibling(child))
+                pending.push_back(child);
+        }
+    });
 
-    ForEverySectorOfFile(dir, [this, &file](const uint8_t *sector_address) {
-        ForEveryDirEntryInDirSector(
-            sector_address, [&file](const FATDirectory *entry) {
-                if (entry->DIR_Attr ==
-                    ToIntegral(FATDirectory::Attr::LongName)) {
-                    const LongNameDirectory *long_dir =
-                        reinterpret_cast<const LongNameDirectory *>(entry);
+    // cross-linked chains share clusters, which are freed once
+    std::sort(clusters.begin(), clusters.end());
+    clusters.erase(std::unique(clusters.begin(), clusters.end()),
+                   clusters.end());
+    WithFATMap([&](auto &fat_map) { fat_map.FreeSorted(clusters); });
+    this->IncreaseFreeClusterCount(clusters.size());
 
-                    if (file.long_name_entries &&
-                        IsOneOfVector(long_dir,
-                                      file.long_name_entries.value())) {
+    for (auto target : targets)
+        RemoveEntryInDir(target);
+}
 
-                        ASSERT(entry->DIR_Name.name[0] != 0xE5);
-                        memset((void *)(&(entry->DIR_Name.name[0])), 0xE5, 1);
-                        ASSERT(entry->DIR_Name.name[0] == 0xE5);
-                    }
-                } else {
-                    uint32_t cluster =
-                        entry->DIR_FstClusLO | (entry->DIR_FstClusHI << 16);
-                    if (cluster == file.first_cluster) {
-                        memset((void *)(&entry->DIR_Name.name[0]), 0xE5, 1);
-                    }
-                }
-            });
-    });
+void FATManager::RemoveEntryInDir(NodeId file) {
+    auto &node = tree_[file];
+    for (uint32_t i = 0; i < node.slot_count; i++) {
+        auto entry = SlotOfDir(node.parent, node.first_slot + i);
+        entry->DIR_Name.name[0] = 0xE5;
+        MarkMetadata(entry, 1);
+    }
+    if (auto it = free_slots_.find(node.parent); it != free_slots_.end())
+        it->second.Release(node.first_slot, node.slot_count);
+    tree_.Remove(file);
 }
 
-void FATManager::CopyFileFrom(const std::string &path,
-                              const std::string &dest) {
-    auto get_file_name = [](const std::string path) -> std::string {
-        auto pos = path.find_last_of('/');
-        if (pos == std::string::npos) {
-            return path;
-        } else {
-            return path.substr(pos + 1);
+// the [start, end) ranges of fd that hold data; everything else reads as
+// zeros, and without SEEK_DATA support the whole file is one range
+static std::vector<std::pair<uint64_t, uint64_t>> DataSegmentsOf(int fd,
+                                                                 off_t size) {
+    std::vector<std::pair<uint64_t, uint64_t>> segments;
+    off_t position = 0;
+
+    while (position < size) {
+        auto data = lseek(fd, position, SEEK_DATA);
+        if (data < 0) {
+            if (errno != ENXIO)
+                return {{position, size}};
+            break;
         }
-    };
+        auto hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole > size)
+            hole = size;
+        segments.push_back({data, hole});
+        position = hole;
+    }
+    return segments;
+}
 
-    auto file_name = get_file_name(dest);
+static bool ReadFully(int fd, uint8_t *data, size_t size, off_t offset) {
+    while (size > 0) {
+        auto size_read = pread(fd, data, size, offset);
+        if (size_read < 0 && errno == EINTR)
+            continue;
+        if (size_read <= 0)
+            return false;
+        data += size_read;
+        size -= size_read;
+        offset += size_read;
+    }
+    return true;
+}
+
+// collapse clusters handed out by the allocator into runs
+static std::vector<Extent>
+ExtentsOfClusters(const std::vector<uint32_t> &clusters) {
+    std::vector<Extent> extents;
+    for (auto cluster : clusters) {
+        if (!extents.empty() && extents.back().start_cluster +
+                                        extents.back().length ==
+                                    cluster)
+            extents.back().length++;
+        else
+            extents.push_back({cluster, 1});
+    }
+    return extents;
+}
+
+void FATManager::CopyFileFrom(const std::string &path, const std::string &dest,
+                              AllocPolicy policy) {
+    auto file_name = std::string(SplitPath(dest).second);
 
     if (file_name.size() > 255) {
-        std::cerr << "file name too long (more than 255 bytes)" << std::endl;
-        std::exit(1);
+        throw FATError("file name too long (more than 255 bytes)");
     }
 
-    auto file = FindFile(dest);
-    if (file) {
-        Delete(dest);
+    // a directory of that name is not replaced, nor shadowed by a second
+    // entry
+    if (auto existing = Resolve(dest); existing != kNoNode) {
+        if (tree_.IsDir(existing)) {
+            throw FATError(dest + " is a directory");
+        }
+        DeleteNodes({existing});
     }
     // open path for reading
     auto c_file_fd = open(path.c_str(), O_RDONLY);
     if (c_file_fd == -1) {
-        std::cerr << "failed to open file " << path << std::endl;
-        std::exit(1);
+        throw FATError("failed to open file " + path);
     }
 
     // get the size of the file
     struct stat file_stat;
     if (fstat(c_file_fd, &file_stat) == -1) {
-        std::cerr << "failed to get file stat" << std::endl;
         close(c_file_fd);
-        std::exit(1);
+        throw FATError("failed to get file stat");
     }
     auto size = file_stat.st_size;
 
     // get the parent dir of the file
-    // std::cout << "dest: " << dest << std::endl;
-    auto parent_dir_op = FindParentDir(dest);
+    auto parent_dir = FindParentDir(dest);
 
-    if (!parent_dir_op) {
-        std::cerr << "parent dir not found" << std::endl;
+    if (parent_dir == kNoNode) {
         close(c_file_fd);
-        std::exit(1);
+        throw FATError("parent dir not found");
     }
 
-    auto &&parent_dir = parent_dir_op.value().get();
-
     if (size == 0) {
-        auto empty_file = SimpleStruct{file_name, 0, false};
-        WriteFileToDir(parent_dir, empty_file, 0);
         close(c_file_fd);
+        WriteFileToDir(parent_dir, file_name, 0, 0);
+        EndOperation();
         return;
     }
 
+    // DIR_FileSize is 32 bits wide
+    if (size > 0xFFFFFFFF) {
+        close(c_file_fd);
+        throw FATError("file too large (4 GiB or more)");
+    }
+
     // calculate the number of clusters needed
-    uint32_t sector_count_per_cluster = sectors_per_cluster_;
-    uint32_t bytes_per_cluster = bytes_per_sector_ * sector_count_per_cluster;
+    uint32_t bytes_per_cluster = BytesPerCluster();
     uint32_t cluster_count_needed =
         (size + bytes_per_cluster - 1) / bytes_per_cluster;
 
     // if the file is too large, exit
 
-    if (cluster_count_needed > this->fs_info_manager_->GetFreeClusterCount()) {
-        std::cerr << "file too large" << std::endl;
+    auto free_count =
+        WithFATMap([](auto &fat_map) { return fat_map.FreeCount(); });
+    // clusters freed since the last commit are held back until it
+    if (cluster_count_needed > free_count && journal_ &&
+        WithFATMap([](auto &fat_map) { return fat_map.HasHeldFrees(); })) {
+        Commit();
+        free_count =
+            WithFATMap([](auto &fat_map) { return fat_map.FreeCount(); });
+    }
+    if (cluster_count_needed > free_count) {
         close(c_file_fd);
-        std::exit(1);
+        throw FATError("file too large");
     }
 
-    auto clusters_claimed_op = this->fat_map_->FindFree(cluster_count_needed);
+    auto clusters_claimed_op = WithFATMap([&](auto &fat_map) {
+        return fat_map.FindFree(cluster_count_needed, policy);
+    });
 
     if (!clusters_claimed_op) {
-        std::cerr << "failed to find free clusters" << std::endl;
         close(c_file_fd);
-        std::exit(1);
+        throw FATError("failed to find free clusters");
     }
 
     auto &&clusters_claimed = clusters_claimed_op.value();
 
-    this->fs_info_manager_->SetFreeClusterCount(
-        this->fs_info_manager_->GetFreeClusterCount() - cluster_count_needed);
+    // set the chain of clusters
+    WithFATMap([&](auto &fat_map) {
+        for (size_t i = 0; i < clusters_claimed.size() - 1; i++) {
+            fat_map.Set(clusters_claimed[i], clusters_claimed[i + 1]);
+        }
+        fat_map.Set(clusters_claimed[cluster_count_needed - 1],
+                    fat_map.EndMark());
+    });
 
-    this->fs_info_manager_->SetNextFreeCluster(
-        this->fat_map_->FindFree(1).value()[0]);
+    this->DecreaseFreeClusterCount(cluster_count_needed);
 
-    // set the chain of clusters
-    for (size_t i = 0; i < clusters_claimed.size() - 1; i++) {
-        this->fat_map_->Set(clusters_claimed[i], clusters_claimed[i + 1]);
-    }
-    this->fat_map_->Set(clusters_claimed[cluster_count_needed - 1], 0x0FFFFFFF);
-
-    char buffer[bytes_per_sector_];
-    auto size_read_totally = 0;
-
-    // clean the cluster allocated, all 0
-    for (decltype(cluster_count_needed) i = 0; i < cluster_count_needed; i++) {
-        auto first_sector = FirstSectorNumberOfDataCluster(clusters_claimed[i]);
-        for (decltype(sector_count_per_cluster) j = 0;
-             j < sector_count_per_cluster; j++) {
-            auto data = StartAddressOfSector(first_sector + j);
-            memset((void *)data, 0, bytes_per_sector_);
-        }
-    }
-
-    // write the file to the cluster allocated
-    for (decltype(cluster_count_needed) i = 0; i < cluster_count_needed; i++) {
-        // if not the last cluster, write the whole cluster
-        if (i != cluster_count_needed - 1) {
-            auto first_sector =
-                FirstSectorNumberOfDataCluster(clusters_claimed[i]);
-            for (decltype(sector_count_per_cluster) j = 0;
-                 j < sector_count_per_cluster; j++) {
-                auto data = StartAddressOfSector(first_sector + j);
-                auto size_read = read(c_file_fd, buffer, bytes_per_sector_);
-                if (size_read == -1) {
-                    std::cerr << "failed to read file" << std::endl;
-                    close(c_file_fd);
-                    std::exit(1);
-                }
+    this->SaveNextFreeCluster();
 
-                ASSERT(size_read == bytes_per_sector_);
+    // nothing points at the claimed clusters until the directory entry is
+    // written, so a failed read or a full directory gives them back
+    auto extents = ExtentsOfClusters(clusters_claimed);
+    NodeId created_file;
+    try {
+        FillClusters(c_file_fd, size, extents);
+        created_file =
+            WriteFileToDir(parent_dir, file_name, clusters_claimed[0], size);
+    } catch (...) {
+        close(c_file_fd);
+        WithFATMap([&](auto &fat_map) {
+            for (auto cluster : clusters_claimed)
+                fat_map.SetFree(cluster);
+        });
+        this->IncreaseFreeClusterCount(cluster_count_needed);
+        throw;
+    }
+    close(c_file_fd);
 
-                size_read_totally += size_read;
-                memmove((void *)data, buffer, bytes_per_sector_);
+    extents_[created_file] = std::move(extents);
+    EndOperation();
+}
+
+void FATManager::FillClusters(int fd, uint64_t size,
+                              const std::vector<Extent> &extents) {
+    // read the source straight into the claimed runs; only holes in the
+    // source and the tail of the last cluster are zeroed
+    auto segments = DataSegmentsOf(fd, size);
+    size_t segment = 0;
+    uint64_t file_offset = 0;
+
+    for (auto bytes : BytesOfExtents(extents)) {
+        auto data = bytes.data();
+        auto extent_end = data + bytes.size();
+        auto end = file_offset + (extent_end - data);
+        if (end > static_cast<uint64_t>(size))
+            end = size;
+
+        while (file_offset < end) {
+            while (segment < segments.size() &&
+                   segments[segment].second <= file_offset)
+                segment++;
+            auto data_start =
+                segment < segments.size() ? segments[segment].first : end;
+
+            if (data_start > file_offset) {
+                auto hole_end = data_start < end ? data_start : end;
+                memset(data, 0, hole_end - file_offset);
+                data += hole_end - file_offset;
+                file_offset = hole_end;
+                continue;
             }
-        } else {
-            auto first_sector =
-                FirstSectorNumberOfDataCluster(clusters_claimed[i]);
-            // if the last cluster, write the remaining bytes
-            for (decltype(sector_count_per_cluster) j = 0;
-                 j < sector_count_per_cluster; j++) {
-                auto size_read = read(c_file_fd, buffer, bytes_per_sector_);
-                if (size_read == -1) {
-                    std::cerr << "failed to read file" << std::endl;
-                    close(c_file_fd);
-                    std::exit(1);
-                }
-                if (size_read == 0) {
-                    break;
-                }
-                size_read_totally += size_read;
 
-                auto data = StartAddressOfSector(first_sector + j);
-                memmove((void *)data, buffer, size_read);
+            auto data_end =
+                segments[segment].second < end ? segments[segment].second : end;
+            if (!ReadFully(fd, data, data_end - file_offset, file_offset))
+                throw FATError("failed to read file");
+            data += data_end - file_offset;
+            file_offset = data_end;
+        }
+        memset(data, 0, extent_end - data);
+        MarkData(bytes.data(), bytes.size());
+        FlushDataIfLarge();
+    }
+}
+
+FATDirectory *FATManager::SlotOfDir(NodeId dir, uint32_t slot) {
+    auto &extents = ExtentsOf(dir);
+    if (!extents.empty() && extents[0].start_cluster == 0) {
+        if (slot >= root_entry_count_)
+            throw FATError("directory slot out of range");
+        return reinterpret_cast<FATDirectory *>(RootDirRegion()) + slot;
+    }
+
+    auto entry = WithGeometry([&](auto &geometry) -> FATDirectory * {
+        auto cluster_index = geometry.ClusterOfSlot(slot);
+        for (auto &extent : extents) {
+            if (cluster_index < extent.length) {
+                auto data = geometry.Cluster(extent.start_cluster +
+                                             cluster_index);
+                return reinterpret_cast<FATDirectory *>(data) +
+                       geometry.SlotInCluster(slot);
             }
+            cluster_index -= extent.length;
         }
+        return nullptr;
+    });
+    if (entry == nullptr) {
+        throw FATError("directory slot out of range");
     }
+    return entry;
+}
 
-    ASSERT(size_read_totally == size);
+void FATManager::AppendClusterToDir(NodeId dir) {
+    auto &extents = ExtentsOf(dir);
+    if (extents.empty()) {
+        throw FATError("directory has no cluster");
+    }
+    if (extents[0].start_cluster == 0) {
+        throw FATError("root directory is full");
+    }
+    auto last_cluster =
+        extents.back().start_cluster + extents.back().length - 1;
 
-    auto created_file = SimpleStruct{file_name, clusters_claimed[0], false};
-    WriteFileToDir(parent_dir, created_file, size);
+    auto new_cluster_op =
+        WithFATMap([](auto &fat_map) { return fat_map.FindFree(1); });
+    if (!new_cluster_op.has_value()) {
+        throw FATError("no free cluster");
+    }
+    auto new_cluster = new_cluster_op.value()[0];
+    WithFATMap([&](auto &fat_map) {
+        fat_map.template Set<false>(last_cluster, new_cluster);
+        fat_map.Set(new_cluster, fat_map.EndMark());
+    });
+    this->DecreaseFreeClusterCount(1);
+    this->SaveNextFreeCluster();
+
+    // a recycled cluster holds stale data, and the directory must end at
+    // the first 0x00 entry
+    memset(StartAddressOfCluster(new_cluster), 0, BytesPerCluster());
+    MarkMetadata(StartAddressOfCluster(new_cluster), BytesPerCluster());
+    extents_.erase(dir);
+}
 
-    // close the file
-    close(c_file_fd);
+FreeSlots &FATManager::FreeSlotsOf(NodeId dir) {
+    if (auto it = free_slots_.find(dir); it != free_slots_.end())
+        return it->second;
+
+    // everything from the first 0x00 entry on is free
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    std::optional<uint32_t> run_start;
+    auto ended = false;
+    uint32_t capacity = 0;
+    ForEverySlotOfDir(dir, [&](uint32_t slot, const FATDirectory *entry) {
+        capacity = slot + 1;
+        ended = ended || IsFreeDirEntry(entry);
+        if (ended || IsDeletedDirEntry(entry)) {
+            if (!run_start)
+                run_start = slot;
+        } else if (run_start) {
+            runs.push_back({*run_start, slot - *run_start});
+            run_start.reset();
+        }
+        return true;
+    });
+    if (run_start)
+        runs.push_back({*run_start, capacity - *run_start});
+
+    auto &free_slots = free_slots_.emplace(dir, capacity).first->second;
+    for (auto [start, length] : runs)
+        free_slots.Release(start, length);
+    return free_slots;
 }
 
-inline void FATManager::WriteFileToDir(const SimpleStruct &dir,
-                                       const SimpleStruct &file,
-                                       uint32_t size) {
+NodeId FATManager::WriteFileToDir(NodeId dir, const std::string &name,
+                                  uint32_t first_cluster, uint32_t size) {
+    // read the directory before it changes on disk
+    LoadChildren(dir);
 
-    auto long_name_entries = LongNameEntriesOfName(file.name);
+    auto long_name_entries = LongNameEntriesOfName(name);
     {
-        std::string name = "";
+        std::string long_name = "";
         for (auto &entry : long_name_entries) {
             auto [name_part, _] = NameOfLongNameEntry(entry);
-            name = name_part + name;
+            long_name = name_part + long_name;
         }
-        ASSERT_EQ(name, file.name);
+        ASSERT_EQ(long_name, name);
     }
     auto dir_entry = FATDirectory();
 
@@ -689,177 +1456,41 @@ inline void FATManager::WriteFileToDir(const SimpleStruct &dir,
     dir_entry.DIR_CrtDate = 0;
 
     dir_entry.DIR_LstAccDate = 0;
-    dir_entry.DIR_FstClusHI = file.first_cluster >> 16;
+    dir_entry.DIR_FstClusHI = first_cluster >> 16;
     dir_entry.DIR_WrtTime = 0;
     dir_entry.DIR_WrtDate = 0;
-    dir_entry.DIR_FstClusLO = file.first_cluster & 0xffff;
+    dir_entry.DIR_FstClusLO = first_cluster & 0xffff;
     dir_entry.DIR_FileSize = size;
 
-    // write this entries to the dir data block
-    // first, find the first empty entry
-    std::optional<std::tuple<uint8_t *, uint8_t *, uint32_t>>
-        first_empty_entry_and_its_sector_and_cluster;
-
-    ForEverySectorOfFileWithClusterNumber(
-        dir, [this, &first_empty_entry_and_its_sector_and_cluster](
-                 uint32_t cluster_number, uint8_t *data) {
-            auto dir_entry_count_per_sector =
-                this->bytes_per_sector_ / sizeof(FATDirectory);
-
-            if (first_empty_entry_and_its_sector_and_cluster.has_value()) {
-                return;
-            }
-
-            for (decltype(dir_entry_count_per_sector) i = 0;
-                 i < dir_entry_count_per_sector; i++) {
-                auto dir_entry = reinterpret_cast<FATDirectory *>(
-                    data + i * sizeof(FATDirectory));
-
-                if (IsFreeDirEntry(dir_entry)) {
-                    first_empty_entry_and_its_sector_and_cluster =
-                        std::make_tuple(data,
-                                        reinterpret_cast<uint8_t *>(dir_entry),
-                                        cluster_number);
-                    return;
-                }
-            }
-        });
-
-    ASSERT(first_empty_entry_and_its_sector_and_cluster.has_value());
-    // calculate whether there is enough space to write the long name entries
-
-    auto tuple = first_empty_entry_and_its_sector_and_cluster.value();
-    auto first_empty_entry_address = std::get<1>(tuple);
-    auto first_empty_sector_address = std::get<0>(tuple);
-    auto current_cluster = std::get<2>(tuple);
-
-    auto bytes_left_in_sector =
-        bytes_per_sector_ -
-        (first_empty_entry_address - first_empty_sector_address);
-    auto entry_count_left_in_sector =
-        bytes_left_in_sector / sizeof(FATDirectory);
-
-    if (entry_count_left_in_sector < long_name_entries.size() + 1) {
-
-        auto entry_count_needed_extra =
-            long_name_entries.size() + 1 - entry_count_left_in_sector;
-
-        auto sector_needed_extra =
-            (entry_count_needed_extra * sizeof(FATDirectory) +
-             bytes_per_sector_ - 1) /
-            bytes_per_sector_;
-
-        // whether we need to allocate a new cluster
-        auto current_sector_number =
-            SectorNumberOfAddress(first_empty_sector_address);
-        auto first_sector_number_of_current_cluster =
-            FirstSectorNumberOfDataCluster(current_cluster);
-
-        auto cluster_needed_number =
-            [](uint32_t current_sector_number, uint32_t sector_needed_extra,
-               uint32_t sectors_per_cluster,
-               uint32_t first_sector_number_of_current_cluster) -> uint32_t {
-            auto sectors_left_in_current_cluster =
-                sectors_per_cluster - (current_sector_number + 1 -
-                                       first_sector_number_of_current_cluster);
-            if (sector_needed_extra <= sectors_left_in_current_cluster)
-                return 0;
-            else
-                return (sector_needed_extra - sectors_left_in_current_cluster +
-                        sectors_per_cluster - 1) /
-                       sectors_per_cluster;
-        };
-
-        auto sectors_left_in_current_cluster =
-            sectors_per_cluster_ - (current_sector_number + 1 -
-                                    first_sector_number_of_current_cluster);
-
-        auto cluster_needed_extra = cluster_needed_number(
-            current_sector_number, sector_needed_extra, sectors_per_cluster_,
-            first_sector_number_of_current_cluster);
-
-        if (cluster_needed_extra > 0) {
-            // first, write to the current cluster to full
-            auto entries_can_be_written_in_current_cluster =
-                entry_count_left_in_sector + sectors_left_in_current_cluster *
-                                                 bytes_per_sector_ /
-                                                 sizeof(FATDirectory);
-
-            decltype(long_name_entries.size()) entries_written = 0;
-
-            for (decltype(entries_can_be_written_in_current_cluster) i = 0;
-                 i < entries_can_be_written_in_current_cluster; i++) {
-                if (entries_written == long_name_entries.size())
-                    memmove(first_empty_entry_address, &dir_entry,
-                            sizeof(FATDirectory));
-                else
-                    memmove(first_empty_entry_address,
-                            &long_name_entries[entries_written],
-                            sizeof(FATDirectory));
-                entries_written++;
-                first_empty_entry_address += sizeof(FATDirectory);
-            }
+    // the entries take consecutive slots from the smallest free run that
+    // holds them, growing the directory when none does
+    uint32_t slot_count = long_name_entries.size() + 1;
+    auto &free_slots = FreeSlotsOf(dir);
+    auto first_slot = free_slots.Take(slot_count);
+    auto slots_per_cluster = BytesPerCluster() / sizeof(FATDirectory);
+    while (!first_slot) {
+        AppendClusterToDir(dir);
+        free_slots.Grow(slots_per_cluster);
+        first_slot = free_slots.Take(slot_count);
+    }
 
-            auto written_entries_in_current_cluster = 0;
-            auto max_entries_per_cluster =
-                bytes_per_sector_ * sectors_per_cluster_ / sizeof(FATDirectory);
-            uint8_t *data = nullptr;
-
-            while (entries_written < long_name_entries.size() + 1) {
-                if (written_entries_in_current_cluster %
-                        max_entries_per_cluster ==
-                    0) {
-                    // switch to the next cluster
-                    auto next_cluster = this->fat_map_->Lookup(current_cluster);
-                    if (IsEndOfFile(next_cluster)) {
-                        auto new_cluster_op = this->fat_map_->FindFree(1);
-                        if (!new_cluster_op.has_value()) {
-                            std::cerr << "no free cluster" << std::endl;
-                            return;
-                        }
-                        auto &&new_cluster = new_cluster_op.value();
-                        this->fat_map_->Set<false>(current_cluster,
-                                                   new_cluster[0]);
-                        this->fat_map_->Set(new_cluster[0], 0x0FFFFFFF);
-                        this->fs_info_manager_->SetFreeClusterCount(
-                            this->fs_info_manager_->GetFreeClusterCount() - 1);
-                        current_cluster = new_cluster[0];
-                        data = StartAddressOfSector(
-                            FirstSectorNumberOfDataCluster(current_cluster));
-                    }
-                }
-                if (entries_written == long_name_entries.size())
-                    memmove(data, &dir_entry, sizeof(FATDirectory));
-                else
-                    memmove(data, &long_name_entries[entries_written],
-                            sizeof(FATDirectory));
-                entries_written++;
-                written_entries_in_current_cluster++;
-                data += sizeof(FATDirectory);
-            }
-        } else {
-            decltype(long_name_entries.size()) entries_written = 0;
-
-            for (decltype(long_name_entries.size()) i = 0;
-                 i < long_name_entries.size() + 1; i++) {
-                if (entries_written == long_name_entries.size())
-                    memmove(first_empty_entry_address, &dir_entry,
-                            sizeof(FATDirectory));
-                else
-                    memmove(first_empty_entry_address,
-                            &long_name_entries[entries_written],
-                            sizeof(FATDirectory));
-                entries_written++;
-                first_empty_entry_address += sizeof(FATDirectory);
-            }
-        }
-    } else {
-        for (auto &entry : long_name_entries) {
-            memmove(first_empty_entry_address, &entry, sizeof(FATDirectory));
-            first_empty_entry_address += sizeof(FATDirectory);
-        }
-        memmove(first_empty_entry_address, &dir_entry, sizeof(FATDirectory));
+    for (uint32_t i = 0; i < slot_count; i++) {
+        auto entry = SlotOfDir(dir, *first_slot + i);
+        if (i < long_name_entries.size())
+            memmove(entry, &long_name_entries[i], sizeof(FATDirectory));
+        else
+            memmove(entry, &dir_entry, sizeof(FATDirectory));
+        MarkMetadata(entry, sizeof(FATDirectory));
     }
+
+    char short_name[12];
+    auto alias = std::string_view(
+        short_name,
+        ShortNameOf(reinterpret_cast<const char *>(dir_entry.DIR_Name.name),
+                    short_name));
+    return tree_.Add(dir, name, first_cluster, size, dir_entry.DIR_Attr,
+                     *first_slot, slot_count,
+                     NamesEqual(name, alias) ? std::string_view() : alias);
 }
 
 inline const std::string FATManager::Info() const {
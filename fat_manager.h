@@ -1,21 +1,37 @@
 #pragma once
 
+#include "dentry_cache.h"
+#include "dir_index.h"
+#include "dir_tree.h"
+#include "work_stealing.h"
 #include "fat.h"
 #include "fat_map.h"
+#include "free_slots.h"
 #include "fs_info_manager.h"
+#include "generator.h"
+#include "geometry.h"
+#include "journal.h"
+#include "ls_format.h"
 #include <unistd.h>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
 #include <functional>
+#include <iostream>
 #include <memory>
 #include <optional>
+#include <ranges>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
 #include <sys/mman.h>
 #include <unordered_map>
 #include <unordered_set>
+#include <variant>
 #include <vector>
 
 #define ASSERT(x)       assert(x)
@@ -49,16 +65,55 @@ concept StringConvertible = std::convertible_to<T, std::string>;
 template <typename T>
 using OptionalRef = std::optional<std::reference_wrapper<T>>;
 
+// A failed command. It is reported for that command only, so a batch keeps
+// going with the next one.
+class FATError : public std::runtime_error {
+  public:
+    using std::runtime_error::runtime_error;
+};
+
+// When changes are made durable:
+// none: whenever the kernel writes the mapping back
+// end:  once the command or batch is done
+// op:   after every cp and rm
+enum class SyncMode { None, End, Op };
+
 class FATManager {
   private:
     const std::string file_path_;
     uint8_t *image_ = nullptr;
     off_t image_size_ = 0;
+    // kept open so copy-out can hand extents to the kernel
+    int image_fd_ = -1;
     uint32_t root_cluster_number_ = 0;
-    std::unique_ptr<FATMap> fat_map_;
-    std::unordered_map<SimpleStruct, std::vector<SimpleStruct>> dir_map_;
-    SimpleStruct root_dir_;
+    // the FATMap for this volume's entry width, chosen once at open
+    std::optional<std::variant<FATMap<FAT12Entry>, FATMap<FAT16Entry>,
+                               FATMap<FAT32Entry>>>
+        fat_map_;
+    // every directory and file read so far
+    DirTree tree_;
+    // cluster chains decoded so far
+    std::unordered_map<NodeId, std::vector<Extent>> extents_;
+    // free slot runs of the directories written to so far
+    std::unordered_map<NodeId, FreeSlots> free_slots_;
+    // FAT32 only
     std::unique_ptr<FSInfoManager> fs_info_manager_;
+    // cluster addressing for this volume's sizes, chosen once at open
+    std::optional<AnyGeometry> geometry_;
+    std::unique_ptr<DirIndex> dir_index_;
+    bool dir_index_checked_ = false;
+    DentryCache dentry_cache_;
+    unsigned scan_threads_ = 1;
+    // set when changes go through the write-ahead journal; the image is
+    // then mapped privately and only reaches the file on Commit
+    std::unique_ptr<Journal> journal_;
+    SyncMode sync_mode_ = SyncMode::None;
+    // set once the journal or a sync mode needs to know what changed
+    bool track_writes_ = false;
+    // what changed in the mapping since the last commit: file contents, and
+    // everything else (FATs, FSInfo, directory entries)
+    DirtyRanges data_dirty_;
+    DirtyRanges metadata_dirty_;
 
     bool IsFreeDirEntry(const FATDirectory *dir) {
         return dir->DIR_Name.name[0] == 0x00;
@@ -68,70 +123,45 @@ class FATManager {
         return dir->DIR_Name.name[0] == 0xE5; // deleted
     }
 
-    template <typename F>
-    void ForEverySectorOfCluster(uint32_t cluster_number,
-                                 F &&function_for_sector) {
-        auto first_sector_number =
-            FirstSectorNumberOfDataCluster(cluster_number);
-
-        for (int i = 0; i < sectors_per_cluster_; ++i) {
-            auto start_address = StartAddressOfSector(first_sector_number + i);
-            function_for_sector(start_address);
-        }
-    }
-
-    template <typename F>
-    void ForEverySectorOfFile(const SimpleStruct &dir, F &&function) {
-
-        auto cluster_number = dir.first_cluster;
-
-        do {
-            ForEverySectorOfCluster(cluster_number, function);
-            cluster_number = fat_map_->Lookup(cluster_number);
-        } while (!IsEndOfFile(cluster_number));
+    bool IsDotEntry(const FATDirectory *dir) {
+        return dir->DIR_Name.name[0] == '.'; // "." or ".."
     }
 
+    // calls function(slot, entry) for the entries of the directory in
+    // `extents` in order until it returns false
     template <typename F>
-    void ForEverySectorOfFileWithClusterNumber(const SimpleStruct &dir,
-                                               F &&function) {
-
-        auto cluster_number = dir.first_cluster;
-
-        do {
-            // bind the cluster number as the first argument
-            auto function_with_cluster_number =
-                std::bind(function, cluster_number, std::placeholders::_1);
-            ForEverySectorOfCluster(cluster_number,
-                                    function_with_cluster_number);
-            cluster_number = fat_map_->Lookup(cluster_number);
-        } while (!IsEndOfFile(cluster_number));
+    void ForEverySlotOfExtents(const std::vector<Extent> &extents,
+                               F &&function) {
+        uint32_t slot = 0;
+        for (auto bytes : BytesOfExtents(extents)) {
+            auto entries = reinterpret_cast<FATDirectory *>(bytes.data());
+            auto count = bytes.size() / sizeof(FATDirectory);
+            for (size_t i = 0; i < count; ++i, ++slot) {
+                if (!function(slot, &entries[i]))
+                    return;
+            }
+        }
     }
 
-    template <typename F>
-    void ForEveryClusterOfFile(const SimpleStruct &dir, F &&function) {
-        auto cluster_number = dir.first_cluster;
-
-        do {
-            function(cluster_number);
-            cluster_number = fat_map_->Lookup(cluster_number);
-        } while (!IsEndOfFile(cluster_number));
+    template <typename F> void ForEverySlotOfDir(NodeId dir, F &&function) {
+        ForEverySlotOfExtents(ExtentsOf(dir), function);
     }
 
-    template <typename Func>
-    void ForEveryDirEntryInDirSector(const uint8_t *data, Func &&func) {
-        auto dirs_per_sector = bytes_per_sector_ / sizeof(FATDirectory);
-        for (decltype(dirs_per_sector) index = 0; index < dirs_per_sector;
-             ++index) {
-            auto dir = reinterpret_cast<const FATDirectory *>(
-                data + index * sizeof(FATDirectory));
-            if (IsFreeDirEntry(dir)) {
-                break;
-            } else if (IsDeletedDirEntry(dir)) {
-                continue;
-            } else
-                func(dir);
-        }
-    }
+    // a file or directory as its directory is decoded; `name` points into
+    // the decoder and only lasts until the next entry is asked for
+    struct DirEntryView {
+        std::string_view name;
+        // the 8.3 name if it differs from `name`, empty otherwise
+        std::string_view alias;
+        const FATDirectory *entry;
+        uint32_t first_slot;
+        uint8_t slot_count;
+    };
+
+    // the files and directories of the directory stored in `extents`,
+    // decoded one at a time as they are asked for; touches nothing but the
+    // image, so workers can decode directories side by side
+    Generator<DirEntryView> EntriesOf(std::vector<Extent> extents);
 
   protected:
     enum class FATType { FAT12, FAT16, FAT32 };
@@ -145,71 +175,183 @@ class FATManager {
     uint32_t sector_count_per_fat_;
     uint32_t count_of_clusters_;
     uint8_t number_of_fats_;
+    uint32_t first_data_sector_;
+    // entries in the fixed root directory of FAT12/16
+    uint32_t root_entry_count_ = 0;
 
   public:
+    // with `journal`, changes are staged and written through
+    // <image>.journal; a journal left behind by a crash is replayed either
+    // way
     template <StringConvertible T>
-    FATManager(T &&file_path) : file_path_(std::forward<T>(file_path)) {
-        auto diskimg = file_path.c_str();
+    FATManager(T &&file_path, bool journal = false)
+        : file_path_(std::forward<T>(file_path)) {
+        auto diskimg = file_path_.c_str();
         // open the disk image as read-write
         int fd = open(diskimg, O_RDWR);
         if (fd < 0) {
-            perror("open");
-            exit(1);
+            throw FATError(std::string("open: ") + strerror(errno));
+        }
+        if (!Journal::Replay(JournalPath(), fd)) {
+            close(fd);
+            throw FATError(std::string("journal replay: ") + strerror(errno));
         }
         off_t size = lseek(fd, 0, SEEK_END);
         if (size == -1) {
-            perror("lseek");
-            exit(1);
+            close(fd);
+            throw FATError(std::string("lseek: ") + strerror(errno));
         }
         this->image_size_ = size;
 
-        // mmap in READ-WRITE mode
-        // image_ = static_cast<uint8_t *>(
-        //     mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0));
-        image_ =
-            static_cast<uint8_t *>(mmap(NULL, size, O_RDWR, MAP_SHARED, fd, 0));
+        // mmap in READ-WRITE mode, privately when the journal decides what
+        // reaches the file
+        image_ = static_cast<uint8_t *>(
+            mmap(NULL, size, PROT_READ | PROT_WRITE,
+                 journal ? MAP_PRIVATE : MAP_SHARED, fd, 0));
         if (image_ == (void *)-1) {
-            perror("mmap");
-            exit(1);
+            close(fd);
+            throw FATError(std::string("mmap: ") + strerror(errno));
         }
-        close(fd);
+        image_fd_ = fd;
 
         auto hdr = reinterpret_cast<const struct BPB *>(image_);
         InitBPB(*hdr);
+        if (journal)
+            OpenJournal();
     }
 
     ~FATManager() {
+        try {
+            Commit();
+        } catch (const FATError &e) {
+            std::cerr << e.what() << std::endl;
+        }
         if (image_ != nullptr) {
             munmap((void *)image_, image_size_);
         }
+        if (image_fd_ >= 0) {
+            close(image_fd_);
+        }
     }
 
-    void Ls();
+    // lists everything below `path`, or `path` itself if it is a file; in
+    // text, directories end with a slash
+    void Ls(const std::string &path = "/",
+            std::optional<uint32_t> max_depth = std::nullopt,
+            LsFormat format = LsFormat::Text);
 
     void Ck();
 
+    // `dest` may be "-" for stdout
     void CopyFileTo(const std::string &path, const std::string &dest);
 
-    void CopyFileFrom(const std::string &path, const std::string &dest);
+    void CopyFileFrom(const std::string &path, const std::string &dest,
+                      AllocPolicy policy = AllocPolicy::First);
+
+    // deletes every file and directory that `paths` name; a path whose
+    // components hold *, ? or [...] deletes everything it matches
+    void Delete(const std::vector<std::string> &paths);
 
-    void Delete(const std::string &path);
+    // write the sidecar directory index for the current tree
+    void Index();
+
+    // brings the FAT mirrors up to date and makes the changes since the
+    // last commit durable: as one transaction through the journal, or else
+    // by syncing just the ranges they touched in place
+    void Commit();
+
+    void SetSyncMode(SyncMode mode);
+
+    // changes go to FAT #0 and are copied to the other FATs on Commit;
+    // without mirror sync they never are
+    void SetMirrorSync(bool sync);
+
+    // threads used to read the whole directory tree, 1 to read it in place
+    void SetScanThreads(unsigned threads) {
+        scan_threads_ = threads > 0 ? threads : 1;
+    }
+
+    unsigned ScanThreads() const { return scan_threads_; }
 
   private:
-    OptionalRef<SimpleStruct> FindFile(const std::string &path);
+    // the directory at `path`, kNoNode if there is none
+    NodeId ResolveDir(std::string_view path);
+
+    // the file or directory at `path`, found through the dentry cache
+    NodeId Resolve(std::string_view path);
+
+    // a regular file at `path`
+    NodeId FindFile(const std::string &path);
+
+    NodeId FindChild(NodeId dir, std::string_view name);
+
+    void ReadDir(NodeId dir);
+
+    void ReadDirFromIndex(NodeId dir, std::span<const DirIndexEntry> entries);
+
+    // read a directory the first time a lookup touches it
+    void LoadChildren(NodeId dir);
+
+    // read every directory under `root` that has not been read yet
+    void LoadTree(NodeId root = DirTree::kRoot);
+
+    // decode the subtrees under `roots` on scan_threads_ threads
+    void ScanTree(const std::vector<NodeId> &roots);
+
+    // the files and directories matching `pattern`, compared without
+    // regard to case
+    std::vector<NodeId> Glob(std::string_view pattern);
+
+    // frees the clusters of everything under `targets` in one sorted pass,
+    // updates FSInfo once and clears the targets' entries
+    void DeleteNodes(std::vector<NodeId> targets);
+
+    // clears the entries of `file` on disk and drops it from the tree
+    void RemoveEntryInDir(NodeId file);
+
+    std::string JournalPath() const { return file_path_ + ".journal"; }
+
+    // opens the journal and starts tracking writes and holding frees
+    void OpenJournal();
 
-    std::optional<std::vector<std::reference_wrapper<SimpleStruct>>>
-    FindFileWithDirs(const std::string &path);
+    void TrackWrites();
 
-    void DeleteSingleFile(const SimpleStruct &file);
+    // commits after an operation under SyncMode::Op, or when enough has
+    // piled up for the journal
+    void EndOperation();
 
-    void DeleteSingleDir(const SimpleStruct &dir);
+    // msyncs the pages under `ranges`
+    void SyncRanges(const std::vector<ByteRange> &ranges);
 
-    void RemoveEntryInDir(const SimpleStruct &dir, const SimpleStruct &file);
+    // staged file data past this is written out early, so a large copy
+    // does not keep every page of it privately mapped
+    static constexpr uint64_t kDataFlushBytes = 64 << 20;
+    // staged metadata past this is committed at the end of the operation
+    // rather than with the rest of the batch
+    static constexpr uint64_t kGroupCommitBytes = 16 << 20;
+
+    // records a write of file contents, or of anything else, in the mapping
+    void MarkData(const void *address, size_t size) {
+        if (track_writes_)
+            data_dirty_.Add(address, size);
+    }
+
+    void MarkMetadata(const void *address, size_t size) {
+        if (track_writes_)
+            metadata_dirty_.Add(address, size);
+    }
+
+    void FlushDataIfLarge();
+
+    // drops the private copies of the pages under `ranges` so they are
+    // read from the file again; with `whole_pages`, pages the ranges only
+    // partly cover are kept
+    void DropPages(const std::vector<ByteRange> &ranges, bool whole_pages);
 
     inline const std::string Info() const;
 
     inline uint8_t *StartAddressOfSector(uint32_t sector_number) const {
-        return image_ + (sector_number * bytes_per_sector_);
+        return image_ + (uint64_t{sector_number} * bytes_per_sector_);
     }
 
     inline uint32_t SectorNumberOfAddress(uint8_t *address) const {
@@ -222,41 +364,145 @@ class FATManager {
 
     void InitBPB(const BPB &bpb);
 
-    inline uint32_t FirstSectorNumberOfDataCluster(uint32_t cluster_number) {
-        ASSERT(cluster_number >= 2);
-        ASSERT(cluster_number <= MaximumValidClusterNumber());
+    inline std::string IndexPath() const { return file_path_ + ".fatidx"; }
+
+    // use the sidecar index if it still describes this image
+    void LoadDirIndex();
+
+    // whether the sidecar index can be used; checking it hashes the FAT and
+    // every directory, so that only happens when a whole tree is about to
+    // be read, not at open
+    bool HaveDirIndex() {
+        if (!dir_index_checked_)
+            LoadDirIndex();
+        return dir_index_ != nullptr;
+    }
+
+    // whether reading the tree below `dir` should go through the index:
+    // below the root, checking it would cost more than the scan it saves
+    bool UseDirIndexFor(NodeId dir) {
+        return dir_index_ || (dir == DirTree::kRoot && HaveDirIndex());
+    }
+
+    std::optional<DirIndexHeader>
+    IdentityOfImage(const std::vector<uint32_t> &dir_clusters);
+
+    // the fixed root directory of FAT12/16, right after the FATs
+    inline uint8_t *RootDirRegion() const {
+        return StartAddressOfSector(reserved_sector_count_ +
+                                    number_of_fats_ * sector_count_per_fat_);
+    }
 
-        auto first_data_sector =
-            reserved_sector_count_ + (number_of_fats_ * sector_count_per_fat_);
+    // runs function(geometry) on the Geometry of this volume
+    template <typename F> decltype(auto) WithGeometry(F &&function) {
+        return std::visit(std::forward<F>(function), *geometry_);
+    }
 
-        return (cluster_number - 2) * sectors_per_cluster_ + first_data_sector;
+    // runs function(fat_map) on the FATMap of this volume
+    template <typename F> decltype(auto) WithFATMap(F &&function) {
+        return std::visit(std::forward<F>(function), *fat_map_);
     }
 
-    inline bool IsEndOfFile(uint32_t fat_entry_value) const {
-        ASSERT(fat_type_ == FATType::FAT32);
-        return fat_entry_value >= 0x0FFFFFF8;
+    inline uint32_t CountFreeClusters() {
+        return WithFATMap([](auto &fat_map) { return fat_map.CountFree(); });
     }
 
+    // Both are called after the FAT has been updated. FSI_Free_Count may be
+    // 0xFFFFFFFF (unknown) or simply wrong, in which case it is recounted.
+    // FAT12 and FAT16 keep no count.
     inline void DecreaseFreeClusterCount(uint32_t number) {
-        this->fs_info_manager_->SetFreeClusterCount(
-            this->fs_info_manager_->GetFreeClusterCount() - number);
+        if (!fs_info_manager_)
+            return;
+        auto count = this->fs_info_manager_->GetFreeClusterCount();
+        if (count > count_of_clusters_ || count < number)
+            count = CountFreeClusters() + number;
+        this->fs_info_manager_->SetFreeClusterCount(count - number);
     }
 
     inline void IncreaseFreeClusterCount(uint32_t number) {
-        this->fs_info_manager_->SetFreeClusterCount(
-            this->fs_info_manager_->GetFreeClusterCount() + number);
+        if (!fs_info_manager_)
+            return;
+        auto count = this->fs_info_manager_->GetFreeClusterCount();
+        if (count > count_of_clusters_ - number)
+            count = CountFreeClusters() - number;
+        this->fs_info_manager_->SetFreeClusterCount(count + number);
     }
 
-    inline std::vector<uint32_t> ClustersOfFile(const SimpleStruct &file) {
-        std::vector<uint32_t> cluster_entries;
-        ForEveryClusterOfFile(file, [&cluster_entries](uint32_t cluster) {
-            cluster_entries.push_back(cluster);
+    // stores where the next allocation starts in FSInfo, on FAT32
+    inline void SaveNextFreeCluster() {
+        if (!fs_info_manager_)
+            return;
+        fs_info_manager_->SetNextFreeCluster(WithFATMap(
+            [](auto &fat_map) { return fat_map.NextFreeHint(); }));
+    }
+
+    // calls function(extent) for each run of consecutive clusters in the
+    // chain from `first_cluster`
+    template <typename F>
+    void ForEveryExtentOfChain(uint32_t first_cluster, F &&function) {
+        // empty files have no cluster; a looping chain is cut off once it
+        // is longer than the volume
+        WithFATMap([&](auto &fat_map) {
+            for (auto &extent :
+                 fat_map.Chain(first_cluster, count_of_clusters_))
+                function(extent);
         });
-        return cluster_entries;
     }
 
-    inline void WriteFileToDir(const SimpleStruct &dir,
-                               const SimpleStruct &file, uint32_t size);
+    // the cluster chain from `first_cluster` as runs of consecutive clusters
+    std::vector<Extent> ChainOf(uint32_t first_cluster);
+
+    // the chain of `file`, cached; on FAT12/16 the root directory is the
+    // single extent {0, 0}, which stands for the fixed root region
+    const std::vector<Extent> &ExtentsOf(NodeId file);
+
+    inline uint32_t BytesPerCluster() const {
+        return bytes_per_sector_ * sectors_per_cluster_;
+    }
+
+    inline uint8_t *StartAddressOfCluster(uint32_t cluster_number) {
+        ASSERT(cluster_number >= 2);
+        ASSERT(cluster_number <= MaximumValidClusterNumber());
+        return WithGeometry([cluster_number](auto &geometry) {
+            return geometry.Cluster(cluster_number);
+        });
+    }
+
+    // the bytes `extent` covers in the image; {0, 0} is the FAT12/16 root
+    inline std::span<uint8_t> BytesOf(const Extent &extent) {
+        if (extent.start_cluster == 0)
+            return {RootDirRegion(), root_entry_count_ * sizeof(FATDirectory)};
+        ASSERT(extent.start_cluster >= 2);
+        ASSERT(extent.start_cluster + extent.length - 1 <=
+               MaximumValidClusterNumber());
+        return WithGeometry([&extent](auto &geometry) {
+            return geometry.BytesOf(extent.start_cluster, extent.length);
+        });
+    }
+
+    // `extents` as the bytes of each, in order
+    auto BytesOfExtents(const std::vector<Extent> &extents) {
+        return extents | std::views::transform([this](const Extent &extent) {
+                   return BytesOf(extent);
+               });
+    }
+
+    FATDirectory *SlotOfDir(NodeId dir, uint32_t slot);
+
+    // links a zeroed cluster at the end of `dir`
+    void AppendClusterToDir(NodeId dir);
+
+    // the free slot runs of `dir`, found by one pass over its slots the
+    // first time
+    FreeSlots &FreeSlotsOf(NodeId dir);
+
+    // copies the first `size` bytes of `fd` into `extents`
+    void FillClusters(int fd, uint64_t size,
+                      const std::vector<Extent> &extents);
+
+    // writes the entries of a file on disk and adds it to the tree
+    NodeId WriteFileToDir(NodeId dir, const std::string &name,
+                          uint32_t first_cluster, uint32_t size);
 
     inline uint8_t CheckSumOfShortName(FATDirectory::ShortName *name) {
         uint8_t sum = 0;
@@ -273,7 +519,11 @@ class FATManager {
     inline std::vector<LongNameDirectory>
     LongNameEntriesOfName(const std::string &name);
 
-    OptionalRef<SimpleStruct> FindParentDir(const std::string &path);
+    // "/a/b" for the node at /a/b, "" for the root
+    std::string PathOf(NodeId node);
+
+    // the directory that would hold `path`
+    NodeId FindParentDir(const std::string &path);
 };
 
 } // namespace cs5250
@@ -1,30 +1,378 @@
 #pragma once
 
+#include "dirty_ranges.h"
+#include "fat.h"
+#include "fat_entry.h"
+#include "fat_simd.h"
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #define ASSERT(x) assert(x)
 
 namespace cs5250 {
 
-class FATMap {
+// first:  the next free clusters after the hint, wherever they are
+// contig: the first free run after the hint that holds the whole file
+// best:   the smallest free run that holds the whole file
+// contig and best fall back to the fewest (largest) runs when no single
+// run is big enough
+enum class AllocPolicy { First, Contig, Best };
+
+// The chain from a first cluster, one run of consecutive clusters at a
+// time and without building a vector. The link out of a run is read before
+// the run is handed out, so the caller may free it on the way. A chain
+// that loops is cut off once it is longer than `max_clusters`.
+template <typename Map> class ChainRange {
+  public:
+    class Iterator {
+      private:
+        Map *map_ = nullptr;
+        Extent extent_ = {0, 0};
+        uint32_t next_ = 0;
+        uint32_t seen_ = 0;
+        uint32_t max_clusters_ = 0;
+
+        void Load(uint32_t cluster_number) {
+            if (cluster_number == 0 || map_->IsEndOfFile(cluster_number) ||
+                seen_ > max_clusters_) {
+                extent_ = {0, 0};
+                return;
+            }
+            auto run = map_->RunLength(cluster_number);
+            extent_ = {cluster_number, run};
+            seen_ += run;
+            next_ = map_->Lookup(cluster_number + run - 1);
+        }
+
+      public:
+        using value_type = Extent;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator() = default;
+
+        Iterator(Map *map, uint32_t first_cluster, uint32_t max_clusters)
+            : map_(map), max_clusters_(max_clusters) {
+            Load(first_cluster);
+        }
+
+        const Extent &operator*() const { return extent_; }
+
+        Iterator &operator++() {
+            Load(next_);
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        bool operator==(std::default_sentinel_t) const {
+            return extent_.length == 0;
+        }
+    };
+
+    ChainRange(Map &map, uint32_t first_cluster, uint32_t max_clusters)
+        : map_(&map), first_cluster_(first_cluster),
+          max_clusters_(max_clusters) {}
+
+    Iterator begin() const {
+        return Iterator(map_, first_cluster_, max_clusters_);
+    }
+
+    std::default_sentinel_t end() const { return {}; }
+
+  private:
+    Map *map_;
+    uint32_t first_cluster_;
+    uint32_t max_clusters_;
+};
+
+// The FATs of a volume with entries read and written through `Entry`
+// (FAT12Entry, FAT16Entry or FAT32Entry). FAT32 scans go through the SIMD
+// kernels, the narrower widths through plain loops.
+template <typename Entry> class FATMap {
   private:
+    static constexpr bool kWide = std::is_same_v<Entry, FAT32Entry>;
+
+    // mirrors are brought up to date a page of FAT at a time
+    static constexpr uint32_t kMirrorPageShift = 12;
+
     uint8_t fat_num_;
+    size_t fat_bytes_;
     uint32_t size_;
-    std::vector<uint32_t *> cluster_starts_;
+    // FAT #0 first; changes go there and reach the mirrors in SyncMirrors
+    std::vector<uint8_t *> cluster_starts_;
+    // one bit per page of FAT #0 changed since the mirrors were synced
+    std::vector<uint64_t> mirror_dirty_;
+    bool mirror_sync_ = true;
+
+    // clusters [2, cluster_end_) are backed by the data region
+    uint32_t cluster_end_;
+    uint32_t next_free_;
+
+    // one bit per cluster, set when the cluster is free; a bit in the
+    // summary is set when the corresponding word of free_bits_ is non-zero
+    std::vector<uint64_t> free_bits_;
+    std::vector<uint64_t> free_summary_;
+    uint32_t free_count_ = 0;
+    bool free_bits_built_ = false;
+
+    // where FAT writes are recorded, if anywhere
+    DirtyRanges *dirty_ = nullptr;
+    // while frees are held, freed clusters stay out of the free bitmap
+    // until ReleaseFrees, so nothing reuses them before the free is durable
+    bool hold_frees_ = false;
+    std::vector<uint32_t> held_frees_;
+
+    const uint32_t *Entries32() const {
+        return reinterpret_cast<const uint32_t *>(cluster_starts_[0]);
+    }
+
+    void BuildFreeBits() {
+        auto words = (cluster_end_ + 63) / 64;
+        free_bits_.assign(words, 0);
+        free_summary_.assign((words + 63) / 64, 0);
+        free_count_ = 0;
+
+        if constexpr (kWide) {
+            FreeEntryMask(Entries32(), 2, cluster_end_, free_bits_.data());
+        } else {
+            for (uint32_t i = 2; i < cluster_end_; i++) {
+                if (Entry::Get(cluster_starts_[0], i) == 0)
+                    free_bits_[i / 64] |= 1ULL << (i % 64);
+            }
+        }
+        for (uint32_t w = 0; w < words; w++) {
+            if (free_bits_[w] != 0) {
+                free_summary_[w / 64] |= 1ULL << (w % 64);
+                free_count_ += __builtin_popcountll(free_bits_[w]);
+            }
+        }
+        free_bits_built_ = true;
+        for (auto cluster_number : held_frees_)
+            MarkUsed(cluster_number);
+    }
+
+    // records a write of `length` bytes at `offset` in FAT #0
+    void Track(size_t offset, size_t length) {
+        if (dirty_)
+            dirty_->Add(cluster_starts_[0] + offset, length);
+        if (cluster_starts_.size() < 2)
+            return;
+        auto first = offset >> kMirrorPageShift;
+        auto last = (offset + length - 1) >> kMirrorPageShift;
+        for (auto page = first; page <= last; page++)
+            mirror_dirty_[page / 64] |= 1ULL << (page % 64);
+    }
+
+    // a FAT12 entry can straddle two pages
+    void Track(uint32_t cluster_number) {
+        Track(Entry::OffsetOf(cluster_number), Entry::kBytes);
+    }
+
+    // frees entries [begin, end) with as few stores as the width allows
+    void ClearRun(uint32_t begin, uint32_t end) {
+        auto fat = cluster_starts_[0];
+        if constexpr (kWide) {
+            ClearEntries(reinterpret_cast<uint32_t *>(fat), begin, end);
+        } else if constexpr (std::is_same_v<Entry, FAT16Entry>) {
+            memset(fat + Entry::OffsetOf(begin), 0,
+                   size_t{end - begin} * Entry::kBytes);
+        } else {
+            for (auto c = begin; c < end; c++)
+                Entry::Put(fat, c, 0);
+        }
+        Track(Entry::OffsetOf(begin),
+              Entry::OffsetOf(end - 1) + Entry::kBytes -
+                  Entry::OffsetOf(begin));
+    }
+
+    // what a free does to the free bitmap
+    void Freed(uint32_t cluster_number) {
+        if (cluster_number < 2 || cluster_number >= cluster_end_)
+            return;
+        if (hold_frees_)
+            held_frees_.push_back(cluster_number);
+        else if (free_bits_built_)
+            MarkFree(cluster_number);
+    }
+
+    void MarkFree(uint32_t cluster_number) {
+        auto w = cluster_number / 64;
+        auto bit = 1ULL << (cluster_number % 64);
+        if (free_bits_[w] & bit)
+            return;
+        free_bits_[w] |= bit;
+        free_summary_[w / 64] |= 1ULL << (w % 64);
+        free_count_++;
+    }
+
+    void MarkUsed(uint32_t cluster_number) {
+        auto w = cluster_number / 64;
+        auto bit = 1ULL << (cluster_number % 64);
+        if (!(free_bits_[w] & bit))
+            return;
+        free_bits_[w] &= ~bit;
+        if (free_bits_[w] == 0)
+            free_summary_[w / 64] &= ~(1ULL << (w % 64));
+        free_count_--;
+    }
+
+    // first free cluster in [from, cluster_end_), cluster_end_ if none
+    uint32_t NextFreeFrom(uint32_t from) const {
+        if (from >= cluster_end_)
+            return cluster_end_;
+
+        auto w = from / 64;
+        auto bits = free_bits_[w] & (~0ULL << (from % 64));
+        if (bits != 0)
+            return w * 64 + __builtin_ctzll(bits);
+
+        // skip whole words with no free cluster through the summary
+        auto s = (w + 1) / 64;
+        auto summary = s < free_summary_.size()
+                           ? free_summary_[s] & (~0ULL << ((w + 1) % 64))
+                           : 0;
+        while (summary == 0) {
+            if (++s >= free_summary_.size())
+                return cluster_end_;
+            summary = free_summary_[s];
+        }
+        w = s * 64 + __builtin_ctzll(summary);
+        return w * 64 + __builtin_ctzll(free_bits_[w]);
+    }
+
+    // end of the free run that starts at `from`
+    uint32_t RunEndFrom(uint32_t from) const {
+        auto w = from / 64;
+        auto used = ~free_bits_[w] & (~0ULL << (from % 64));
+        while (used == 0) {
+            if (++w >= free_bits_.size())
+                return cluster_end_;
+            used = ~free_bits_[w];
+        }
+        auto end = w * 64 + __builtin_ctzll(used);
+        return end < cluster_end_ ? end : cluster_end_;
+    }
+
+    // start of the free run that holds the free cluster `at`; clusters 0
+    // and 1 are never free, so the search stops in the first word at worst
+    uint32_t RunStartOf(uint32_t at) const {
+        auto w = at / 64;
+        auto used = ~free_bits_[w] & (~0ULL >> (63 - at % 64));
+        while (used == 0)
+            used = ~free_bits_[--w];
+        return w * 64 + (64 - __builtin_clzll(used));
+    }
+
+    // calls function(start, length) for the free runs in [from, to) until
+    // it returns false
+    template <typename F>
+    bool ForEveryFreeRun(uint32_t from, uint32_t to, F &&function) const {
+        for (auto start = NextFreeFrom(from); start < to;) {
+            auto end = RunEndFrom(start);
+            if (end > to)
+                end = to;
+            if (!function(start, end - start))
+                return false;
+            start = NextFreeFrom(end);
+        }
+        return true;
+    }
+
+    std::vector<uint32_t> FirstFree(uint32_t num) const {
+        std::vector<uint32_t> free_clusters;
+        free_clusters.reserve(num);
+
+        auto start = next_free_ >= 2 && next_free_ < cluster_end_ ? next_free_
+                                                                  : 2;
+        for (auto i = NextFreeFrom(start);
+             i < cluster_end_ && free_clusters.size() < num;
+             i = NextFreeFrom(i + 1))
+            free_clusters.push_back(i);
+        for (auto i = NextFreeFrom(2);
+             i < start && free_clusters.size() < num; i = NextFreeFrom(i + 1))
+            free_clusters.push_back(i);
+        return free_clusters;
+    }
+
+    std::vector<uint32_t> ContiguousFree(uint32_t num, bool best_fit) const {
+        using Run = std::pair<uint32_t, uint32_t>;
+        std::vector<Run> runs;
+        std::optional<Run> chosen;
+
+        auto consider = [&](uint32_t start, uint32_t length) {
+            if (length >= num) {
+                if (!chosen || length < chosen->second)
+                    chosen = Run{start, length};
+                // contig takes the first fit, best stops on an exact fit
+                return best_fit && chosen->second != num;
+            }
+            if (!chosen)
+                runs.push_back({start, length});
+            return true;
+        };
+
+        auto hint = next_free_ >= 2 && next_free_ < cluster_end_ && !best_fit
+                        ? next_free_
+                        : 2;
+        // the scan wraps around at a run boundary, so the run holding the
+        // hint is seen whole
+        if (free_bits_[hint / 64] & (1ULL << (hint % 64)))
+            hint = RunStartOf(hint);
+        if (ForEveryFreeRun(hint, cluster_end_, consider))
+            ForEveryFreeRun(2, hint, consider);
+
+        std::vector<uint32_t> free_clusters;
+        free_clusters.reserve(num);
+        if (chosen) {
+            for (uint32_t i = 0; i < num; i++)
+                free_clusters.push_back(chosen->first + i);
+            return free_clusters;
+        }
+
+        // no run is big enough: take the largest ones, then lay them out
+        // in disk order
+        std::sort(runs.begin(), runs.end(), [](const Run &a, const Run &b) {
+            return a.second > b.second;
+        });
+        uint32_t covered = 0;
+        size_t used_runs = 0;
+        while (covered < num && used_runs < runs.size())
+            covered += runs[used_runs++].second;
+        runs.resize(used_runs);
+        std::sort(runs.begin(), runs.end());
+
+        for (auto [start, length] : runs) {
+            for (uint32_t i = 0; i < length && free_clusters.size() < num; i++)
+                free_clusters.push_back(start + i);
+        }
+        return free_clusters;
+    }
 
   public:
-    FATMap(uint8_t fat_num, uint32_t size,
-           std::vector<uint32_t *> &&cluster_starts)
-        : fat_num_(fat_num), size_(size), cluster_starts_(cluster_starts) {}
+    // `fat_bytes` is the size of one FAT
+    FATMap(uint8_t fat_num, size_t fat_bytes,
+           std::vector<uint8_t *> &&cluster_starts, uint32_t cluster_end,
+           uint32_t next_free_hint)
+        : fat_num_(fat_num), fat_bytes_(fat_bytes),
+          size_(Entry::CountOf(fat_bytes)), cluster_starts_(cluster_starts),
+          mirror_dirty_(((fat_bytes >> kMirrorPageShift) + 64) / 64, 0),
+          cluster_end_(cluster_end < size_ ? cluster_end : size_),
+          next_free_(next_free_hint) {}
 
     uint32_t Lookup(uint32_t cluster_number) {
         if (cluster_number < 0 || cluster_number >= size_) {
             std::cerr << "cluster number out of range" << std::endl;
             return 0;
         }
-        return cluster_starts_[0][cluster_number] & 0x0FFFFFFF;
+        return Entry::Get(cluster_starts_[0], cluster_number);
     }
 
     void SetFree(uint32_t cluster_number) {
@@ -33,8 +381,29 @@ class FATMap {
             return;
         }
 
-        for (auto &cluster_start : cluster_starts_)
-            cluster_start[cluster_number] = 0;
+        Entry::Put(cluster_starts_[0], cluster_number, 0);
+        Track(cluster_number);
+        Freed(cluster_number);
+    }
+
+    // Frees every cluster in `clusters`, which must be sorted and free of
+    // duplicates. Each run of consecutive clusters is cleared at once.
+    void FreeSorted(const std::vector<uint32_t> &clusters) {
+        size_t i = 0;
+        while (i < clusters.size()) {
+            auto begin = clusters[i];
+            auto end = begin + 1;
+            for (i++; i < clusters.size() && clusters[i] == end; i++)
+                end++;
+            if (begin < 2 || end > size_) {
+                for (auto c = begin; c < end; c++)
+                    SetFree(c);
+                continue;
+            }
+            ClearRun(begin, end);
+            for (auto c = begin; c < end; c++)
+                Freed(c);
+        }
     }
 
     template <bool free_first = true>
@@ -44,31 +413,145 @@ class FATMap {
             return;
         }
 
-        for (auto &cluster_start : cluster_starts_) {
-            if constexpr (free_first)
-                ASSERT(cluster_start[cluster_number] == 0);
-            else {
-                ASSERT(IsEndOfFile(cluster_start[cluster_number]));
+        auto fat = cluster_starts_[0];
+        if constexpr (free_first)
+            ASSERT(Entry::Get(fat, cluster_number) == 0);
+        else {
+            ASSERT(IsEndOfFile(Entry::Get(fat, cluster_number)));
+        }
+        Entry::Put(fat, cluster_number, next_cluster);
+        Track(cluster_number);
+
+        if (free_bits_built_ && cluster_number >= 2 &&
+            cluster_number < cluster_end_)
+            MarkUsed(cluster_number);
+        if constexpr (free_first)
+            next_free_ = cluster_number + 1;
+    }
+
+    void TrackWrites(DirtyRanges *dirty) { dirty_ = dirty; }
+
+    // without mirror sync, the mirrors keep whatever they held at open;
+    // for scratch images only
+    void SetMirrorSync(bool sync) { mirror_sync_ = sync; }
+
+    // copies the pages of FAT #0 changed since the last call to every
+    // other FAT
+    void SyncMirrors() {
+        for (size_t w = 0; w < mirror_dirty_.size(); w++) {
+            auto bits = std::exchange(mirror_dirty_[w], 0);
+            while (mirror_sync_ && bits) {
+                size_t page = w * 64 + __builtin_ctzll(bits);
+                bits &= bits - 1;
+                auto offset = page << kMirrorPageShift;
+                if (offset >= fat_bytes_)
+                    break;
+                auto length = std::min(size_t{1} << kMirrorPageShift,
+                                       fat_bytes_ - offset);
+                for (size_t i = 1; i < cluster_starts_.size(); i++) {
+                    memcpy(cluster_starts_[i] + offset,
+                           cluster_starts_[0] + offset, length);
+                    if (dirty_)
+                        dirty_->Add(cluster_starts_[i] + offset, length);
+                }
             }
-            cluster_start[cluster_number] = next_cluster;
         }
     }
 
+    void HoldFrees(bool hold) { hold_frees_ = hold; }
+
+    bool HasHeldFrees() const { return !held_frees_.empty(); }
+
+    // makes the clusters freed while frees were held available again
+    void ReleaseFrees() {
+        if (free_bits_built_) {
+            for (auto cluster_number : held_frees_)
+                MarkFree(cluster_number);
+        }
+        held_frees_.clear();
+    }
+
     inline bool IsEndOfFile(uint32_t fat_entry_value) const {
-        return fat_entry_value >= 0x0FFFFFF8;
+        return fat_entry_value >= Entry::kEndOfChain;
+    }
+
+    // the value that ends a chain
+    uint32_t EndMark() const { return Entry::kEndMark; }
+
+    // the runs of the chain from `first_cluster`
+    ChainRange<FATMap> Chain(uint32_t first_cluster, uint32_t max_clusters) {
+        return ChainRange<FATMap>(*this, first_cluster, max_clusters);
+    }
+
+    // number of clusters in the run of consecutive links that starts at
+    // `cluster_number`, at least 1
+    uint32_t RunLength(uint32_t cluster_number) {
+        if (cluster_number >= cluster_end_)
+            return 1;
+        if constexpr (kWide) {
+            return ConsecutiveLinks(Entries32(), cluster_number,
+                                    cluster_end_) +
+                   1;
+        } else {
+            auto c = cluster_number;
+            while (c + 1 < cluster_end_ &&
+                   Entry::Get(cluster_starts_[0], c) == c + 1)
+                c++;
+            return c - cluster_number + 1;
+        }
+    }
+
+    // recount the free entries straight from the FAT; clusters held back
+    // until a commit are free there though the bitmap leaves them out
+    uint32_t CountFree() const {
+        if (free_bits_built_ && held_frees_.empty())
+            return free_count_;
+        if constexpr (kWide) {
+            return CountFreeEntries(Entries32(), 2, cluster_end_);
+        } else {
+            uint32_t count = 0;
+            for (uint32_t i = 2; i < cluster_end_; i++)
+                count += Entry::Get(cluster_starts_[0], i) == 0;
+            return count;
+        }
+    }
+
+    uint32_t FreeCount() {
+        if (!free_bits_built_)
+            BuildFreeBits();
+        return free_count_;
     }
 
-    std::optional<std::vector<uint32_t>> FindFree(uint32_t num) {
+    // where the next allocation starts looking (FSI_Nxt_Free)
+    uint32_t NextFreeHint() const { return next_free_; }
+
+    // Hands out `num` free clusters according to `policy`; the search
+    // starts at the next free hint and wraps around to cluster 2. The free
+    // bitmap is built on first use.
+    std::optional<std::vector<uint32_t>>
+    FindFree(uint32_t num, AllocPolicy policy = AllocPolicy::First) {
+        if (!free_bits_built_)
+            BuildFreeBits();
+        if (num > free_count_)
+            return std::nullopt;
+
         std::vector<uint32_t> free_clusters;
-        for (uint32_t i = 0; i < size_; i++) {
-            if (Lookup(i) == 0) {
-                free_clusters.push_back(i);
-                if (free_clusters.size() == num)
-                    return free_clusters;
-            }
+        switch (policy) {
+        case AllocPolicy::First:
+            free_clusters = FirstFree(num);
+            break;
+        case AllocPolicy::Contig:
+            free_clusters = ContiguousFree(num, false);
+            break;
+        case AllocPolicy::Best:
+            free_clusters = ContiguousFree(num, true);
+            break;
         }
-        return std::nullopt;
+
+        if (free_clusters.size() < num)
+            return std::nullopt;
+        return free_clusters;
     }
 };
 
-} // namespace cs5250
\ No newline at end of file
+} // namespace cs5250
@@ -0,0 +1,269 @@
+#include "fat_simd.h"
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SIMD_X86 1
+#endif
+
+namespace cs5250 {
+
+static constexpr uint32_t kEntryMask = 0x0FFFFFFF;
+
+static size_t CountFreeScalar(const uint32_t *fat, size_t begin, size_t end) {
+    size_t count = 0;
+    for (auto i = begin; i < end; i++) {
+        if ((fat[i] & kEntryMask) == 0)
+            count++;
+    }
+    return count;
+}
+
+static void FreeMaskScalar(const uint32_t *fat, size_t begin, size_t end,
+                           uint64_t *bits) {
+    for (auto i = begin; i < end; i++) {
+        if ((fat[i] & kEntryMask) == 0)
+            bits[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+static uint32_t LinksScalar(const uint32_t *fat, uint32_t cluster,
+                            uint32_t end) {
+    auto c = cluster;
+    while (c + 1 < end && (fat[c] & kEntryMask) == c + 1)
+        c++;
+    return c > cluster ? c - cluster : 0;
+}
+
+static void ClearScalar(uint32_t *fat, size_t begin, size_t end) {
+    for (auto i = begin; i < end; i++)
+        fat[i] &= ~kEntryMask;
+}
+
+#ifdef FAT_SIMD_X86
+
+__attribute__((target("avx2"))) static size_t
+CountFreeAvx2(const uint32_t *fat, size_t begin, size_t end) {
+    const auto mask = _mm256_set1_epi32(kEntryMask);
+    const auto zero = _mm256_setzero_si256();
+    auto acc0 = _mm256_setzero_si256();
+    auto acc1 = _mm256_setzero_si256();
+
+    // a matching lane is -1, so subtracting counts it
+    auto i = begin;
+    for (; i + 16 <= end; i += 16) {
+        auto v0 = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(fat + i));
+        auto v1 = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i *>(fat + i + 8));
+        acc0 = _mm256_sub_epi32(
+            acc0, _mm256_cmpeq_epi32(_mm256_and_si256(v0, mask), zero));
+        acc1 = _mm256_sub_epi32(
+            acc1, _mm256_cmpeq_epi32(_mm256_and_si256(v1, mask), zero));
+    }
+
+    uint32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(lanes),
+                        _mm256_add_epi32(acc0, acc1));
+    size_t count = 0;
+    for (auto lane : lanes)
+        count += lane;
+    return count + CountFreeScalar(fat, i, end);
+}
+
+__attribute__((target("avx2"))) static void
+FreeMaskAvx2(const uint32_t *fat, size_t begin, size_t end, uint64_t *bits) {
+    const auto mask = _mm256_set1_epi32(kEntryMask);
+    const auto zero = _mm256_setzero_si256();
+
+    auto i = begin;
+    auto head_end = (begin + 63) / 64 * 64;
+    FreeMaskScalar(fat, begin, head_end < end ? head_end : end, bits);
+    i = head_end;
+
+    for (; i + 64 <= end; i += 64) {
+        uint64_t word = 0;
+        for (int k = 0; k < 8; k++) {
+            auto v = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i *>(fat + i + k * 8));
+            auto eq = _mm256_cmpeq_epi32(_mm256_and_si256(v, mask), zero);
+            word |= static_cast<uint64_t>(
+                        _mm256_movemask_ps(_mm256_castsi256_ps(eq)))
+                    << (k * 8);
+        }
+        bits[i / 64] |= word;
+    }
+    if (i < end)
+        FreeMaskScalar(fat, i, end, bits);
+}
+
+__attribute__((target("avx2"))) static uint32_t
+LinksAvx2(const uint32_t *fat, uint32_t cluster, uint32_t end) {
+    const auto mask = _mm256_set1_epi32(kEntryMask);
+    const auto step = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 8);
+
+    // the last lane links to c + 8, which has to stay below `end`
+    auto c = cluster;
+    for (; c + 8 < end; c += 8) {
+        auto v = _mm256_and_si256(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(fat + c)),
+            mask);
+        auto expected = _mm256_add_epi32(_mm256_set1_epi32(c), step);
+        auto linked = _mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpeq_epi32(v, expected)));
+        if (linked != 0xFF)
+            return c + __builtin_ctz(~linked & 0xFF) - cluster;
+    }
+    return c - cluster + LinksScalar(fat, c, end);
+}
+
+__attribute__((target("avx2"))) static void
+ClearAvx2(uint32_t *fat, size_t begin, size_t end) {
+    const auto reserved = _mm256_set1_epi32(~kEntryMask);
+
+    auto i = begin;
+    for (; i + 8 <= end; i += 8) {
+        auto p = reinterpret_cast<__m256i *>(fat + i);
+        _mm256_storeu_si256(
+            p, _mm256_and_si256(_mm256_loadu_si256(p), reserved));
+    }
+    ClearScalar(fat, i, end);
+}
+
+__attribute__((target("sse4.1"))) static size_t
+CountFreeSse4(const uint32_t *fat, size_t begin, size_t end) {
+    const auto mask = _mm_set1_epi32(kEntryMask);
+    const auto zero = _mm_setzero_si128();
+    auto acc0 = _mm_setzero_si128();
+    auto acc1 = _mm_setzero_si128();
+
+    auto i = begin;
+    for (; i + 8 <= end; i += 8) {
+        auto v0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(fat + i));
+        auto v1 =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(fat + i + 4));
+        acc0 = _mm_sub_epi32(acc0,
+                             _mm_cmpeq_epi32(_mm_and_si128(v0, mask), zero));
+        acc1 = _mm_sub_epi32(acc1,
+                             _mm_cmpeq_epi32(_mm_and_si128(v1, mask), zero));
+    }
+
+    uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(lanes),
+                     _mm_add_epi32(acc0, acc1));
+    size_t count = 0;
+    for (auto lane : lanes)
+        count += lane;
+    return count + CountFreeScalar(fat, i, end);
+}
+
+__attribute__((target("sse4.1"))) static void
+FreeMaskSse4(const uint32_t *fat, size_t begin, size_t end, uint64_t *bits) {
+    const auto mask = _mm_set1_epi32(kEntryMask);
+    const auto zero = _mm_setzero_si128();
+
+    auto i = begin;
+    auto head_end = (begin + 63) / 64 * 64;
+    FreeMaskScalar(fat, begin, head_end < end ? head_end : end, bits);
+    i = head_end;
+
+    for (; i + 64 <= end; i += 64) {
+        uint64_t word = 0;
+        for (int k = 0; k < 16; k++) {
+            auto v = _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(fat + i + k * 4));
+            auto eq = _mm_cmpeq_epi32(_mm_and_si128(v, mask), zero);
+            word |= static_cast<uint64_t>(
+                        _mm_movemask_ps(_mm_castsi128_ps(eq)))
+                    << (k * 4);
+        }
+        bits[i / 64] |= word;
+    }
+    if (i < end)
+        FreeMaskScalar(fat, i, end, bits);
+}
+
+__attribute__((target("sse4.1"))) static uint32_t
+LinksSse4(const uint32_t *fat, uint32_t cluster, uint32_t end) {
+    const auto mask = _mm_set1_epi32(kEntryMask);
+    const auto step = _mm_setr_epi32(1, 2, 3, 4);
+
+    auto c = cluster;
+    for (; c + 4 < end; c += 4) {
+        auto v = _mm_and_si128(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(fat + c)), mask);
+        auto expected = _mm_add_epi32(_mm_set1_epi32(c), step);
+        auto linked =
+            _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, expected)));
+        if (linked != 0xF)
+            return c + __builtin_ctz(~linked & 0xF) - cluster;
+    }
+    return c - cluster + LinksScalar(fat, c, end);
+}
+
+__attribute__((target("sse4.1"))) static void
+ClearSse4(uint32_t *fat, size_t begin, size_t end) {
+    const auto reserved = _mm_set1_epi32(~kEntryMask);
+
+    auto i = begin;
+    for (; i + 4 <= end; i += 4) {
+        auto p = reinterpret_cast<__m128i *>(fat + i);
+        _mm_storeu_si128(p, _mm_and_si128(_mm_loadu_si128(p), reserved));
+    }
+    ClearScalar(fat, i, end);
+}
+
+#endif
+
+struct ScanKernels {
+    size_t (*count_free)(const uint32_t *, size_t, size_t);
+    void (*free_mask)(const uint32_t *, size_t, size_t, uint64_t *);
+    uint32_t (*links)(const uint32_t *, uint32_t, uint32_t);
+    void (*clear)(uint32_t *, size_t, size_t);
+};
+
+// FAT_SCAN_KERNEL=scalar|sse4.1|avx2 caps the choice, e.g. to test the
+// fallbacks on a machine that has AVX2
+static const ScanKernels &SelectedKernels() {
+    static const ScanKernels kernels = [] {
+        auto wanted = getenv("FAT_SCAN_KERNEL");
+        auto allowed = [wanted](const char *name) {
+            return wanted == nullptr || strcmp(wanted, name) == 0;
+        };
+#ifdef FAT_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && allowed("avx2"))
+            return ScanKernels{CountFreeAvx2, FreeMaskAvx2, LinksAvx2,
+                               ClearAvx2};
+        if (__builtin_cpu_supports("sse4.1") &&
+            (allowed("sse4.1") ||
+             (wanted != nullptr && strcmp(wanted, "avx2") == 0)))
+            return ScanKernels{CountFreeSse4, FreeMaskSse4, LinksSse4,
+                               ClearSse4};
+#endif
+        return ScanKernels{CountFreeScalar, FreeMaskScalar, LinksScalar,
+                           ClearScalar};
+    }();
+    return kernels;
+}
+
+size_t CountFreeEntries(const uint32_t *fat, size_t begin, size_t end) {
+    return SelectedKernels().count_free(fat, begin, end);
+}
+
+void FreeEntryMask(const uint32_t *fat, size_t begin, size_t end,
+                   uint64_t *bits) {
+    SelectedKernels().free_mask(fat, begin, end, bits);
+}
+
+uint32_t ConsecutiveLinks(const uint32_t *fat, uint32_t cluster,
+                          uint32_t end) {
+    return SelectedKernels().links(fat, cluster, end);
+}
+
+void ClearEntries(uint32_t *fat, size_t begin, size_t end) {
+    SelectedKernels().clear(fat, begin, end);
+}
+
+} // namespace cs5250
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cs5250 {
+
+/*
+ * FAT32 scanning kernels
+ *
+ * Every kernel works on raw FAT32 entries, masks them with 0x0FFFFFFF and
+ * comes in AVX2, SSE4.1 and scalar flavours. The widest one the CPU
+ * supports is picked on first use.
+ */
+
+// number of free (zero) entries in [begin, end)
+size_t CountFreeEntries(const uint32_t *fat, size_t begin, size_t end);
+
+// sets bit i % 64 of bits[i / 64] for every free entry i in [begin, end)
+void FreeEntryMask(const uint32_t *fat, size_t begin, size_t end,
+                   uint64_t *bits);
+
+// number of entries i with fat[cluster + i] == cluster + i + 1, counted
+// from `cluster` up to the first that isn't; a link to `end` or past it
+// does not count, so the result is below end - cluster
+uint32_t ConsecutiveLinks(const uint32_t *fat, uint32_t cluster,
+                          uint32_t end);
+
+// frees the entries in [begin, end), keeping their reserved top four bits
+void ClearEntries(uint32_t *fat, size_t begin, size_t end);
+
+} // namespace cs5250
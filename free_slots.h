@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <set>
+#include <utility>
+
+namespace cs5250 {
+
+// Runs of free slots (0x00 or 0xE5) in one directory. A long-name group
+// and its short entry go into the smallest run that holds them, so holes
+// left by deletes are filled before the directory grows.
+class FreeSlots {
+  private:
+    // start -> length
+    std::map<uint32_t, uint32_t> runs_;
+    // (length, start) of the same runs, smallest first
+    std::set<std::pair<uint32_t, uint32_t>> by_length_;
+    // slots the directory's clusters hold
+    uint32_t capacity_;
+
+    void Insert(uint32_t start, uint32_t length) {
+        runs_.emplace(start, length);
+        by_length_.emplace(length, start);
+    }
+
+    void Erase(std::map<uint32_t, uint32_t>::iterator run) {
+        by_length_.erase({run->second, run->first});
+        runs_.erase(run);
+    }
+
+  public:
+    explicit FreeSlots(uint32_t capacity) : capacity_(capacity) {}
+
+    uint32_t Capacity() const { return capacity_; }
+
+    // marks [start, start + count) free, joining the runs on either side
+    void Release(uint32_t start, uint32_t count) {
+        if (count == 0)
+            return;
+        auto end = start + count;
+        auto next = runs_.find(end);
+        if (next != runs_.end()) {
+            end += next->second;
+            Erase(next);
+        }
+        auto previous = runs_.lower_bound(start);
+        if (previous != runs_.begin()) {
+            previous = std::prev(previous);
+            if (previous->first + previous->second == start) {
+                start = previous->first;
+                Erase(previous);
+            }
+        }
+        Insert(start, end - start);
+    }
+
+    // the directory gained `count` slots at its end, all of them free
+    void Grow(uint32_t count) {
+        Release(capacity_, count);
+        capacity_ += count;
+    }
+
+    // the first of `count` slots taken from the smallest run that holds
+    // them, the earliest among equals; nullopt if no run does
+    std::optional<uint32_t> Take(uint32_t count) {
+        auto fit = by_length_.lower_bound({count, 0});
+        if (fit == by_length_.end())
+            return std::nullopt;
+        auto [length, start] = *fit;
+        Erase(runs_.find(start));
+        if (length > count)
+            Insert(start + count, length - count);
+        return start;
+    }
+};
+
+} // namespace cs5250
@@ -1,26 +1,40 @@
 #pragma once
 
+#include "dirty_ranges.h"
 #include "fat.h"
+#include <cstddef>
 #include <cstdint>
 
 namespace cs5250 {
 class FSInfoManager {
   private:
     FSInfo *fs_info_;
+    // where writes are recorded, if anywhere
+    DirtyRanges *dirty_ = nullptr;
+
+    void Track(size_t offset) {
+        if (dirty_)
+            dirty_->Add(reinterpret_cast<uint8_t *>(fs_info_) + offset,
+                        sizeof(uint32_t));
+    }
 
   public:
     FSInfoManager(uint8_t *data) : fs_info_(reinterpret_cast<FSInfo *>(data)) {}
 
+    void TrackWrites(DirtyRanges *dirty) { dirty_ = dirty; }
+
     uint32_t GetFreeClusterCount() { return fs_info_->FSI_Free_Count; }
 
     void SetFreeClusterCount(uint32_t count) {
         fs_info_->FSI_Free_Count = count;
+        Track(offsetof(FSInfo, FSI_Free_Count));
     }
 
     uint32_t GetNextFreeCluster() { return fs_info_->FSI_Nxt_Free; }
 
     void SetNextFreeCluster(uint32_t cluster) {
         fs_info_->FSI_Nxt_Free = cluster;
+        Track(offsetof(FSInfo, FSI_Nxt_Free));
     }
 };
 } // namespace cs5250
\ No newline at end of file
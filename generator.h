@@ -0,0 +1,106 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <utility>
+
+namespace cs5250 {
+
+// A sequence produced lazily by a coroutine that co_yields values of type
+// T, for a single pass with range-for. Yielded values are borrowed from the
+// coroutine and only stay valid until the iterator is advanced; dropping
+// the generator early stops the coroutine where it is.
+template <typename T> class Generator {
+  public:
+    struct promise_type {
+        const T *current = nullptr;
+        std::exception_ptr exception;
+
+        Generator get_return_object() {
+            return Generator(Handle::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        std::suspend_always final_suspend() noexcept { return {}; }
+
+        std::suspend_always yield_value(const T &value) noexcept {
+            current = std::addressof(value);
+            return {};
+        }
+
+        void return_void() {}
+
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    using Handle = std::coroutine_handle<promise_type>;
+
+    class Iterator {
+      private:
+        Handle handle_;
+
+      public:
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+
+        Iterator() = default;
+
+        explicit Iterator(Handle handle) : handle_(handle) {}
+
+        const T &operator*() const { return *handle_.promise().current; }
+
+        const T *operator->() const { return handle_.promise().current; }
+
+        Iterator &operator++() {
+            Resume(handle_);
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        bool operator==(std::default_sentinel_t) const {
+            return !handle_ || handle_.done();
+        }
+    };
+
+    Generator(Generator &&other) noexcept
+        : handle_(std::exchange(other.handle_, {})) {}
+
+    Generator &operator=(Generator &&other) noexcept {
+        if (this != &other) {
+            if (handle_)
+                handle_.destroy();
+            handle_ = std::exchange(other.handle_, {});
+        }
+        return *this;
+    }
+
+    ~Generator() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    // runs the coroutine to its first value; call once
+    Iterator begin() {
+        Resume(handle_);
+        return Iterator(handle_);
+    }
+
+    std::default_sentinel_t end() const { return {}; }
+
+  private:
+    Handle handle_;
+
+    explicit Generator(Handle handle) : handle_(handle) {}
+
+    static void Resume(Handle handle) {
+        handle.resume();
+        if (handle.done() && handle.promise().exception)
+            std::rethrow_exception(handle.promise().exception);
+    }
+};
+
+} // namespace cs5250
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <variant>
+
+namespace cs5250 {
+
+/*
+ * Volume geometry
+ *
+ * Turns cluster numbers and directory slots into addresses in the mapped
+ * image. A power-of-two cluster size from 512 bytes to 64 KiB gets its own
+ * Geometry<log2 of the size>, where every offset is a shift by a constant;
+ * any other size uses Geometry<0>, which multiplies and divides by the
+ * size from the BPB.
+ */
+template <uint32_t kClusterShift> class Geometry {
+  private:
+    static constexpr bool kShift = kClusterShift != 0;
+    // directory entries are 32 bytes
+    static constexpr uint32_t kSlotShift = 5;
+
+    // where cluster 2, the first data cluster, starts
+    uint8_t *data_;
+    // only read by Geometry<0>
+    uint32_t bytes_per_cluster_;
+
+  public:
+    Geometry(uint8_t *data, uint32_t bytes_per_cluster)
+        : data_(data), bytes_per_cluster_(bytes_per_cluster) {}
+
+    uint32_t BytesPerCluster() const {
+        if constexpr (kShift)
+            return 1u << kClusterShift;
+        return bytes_per_cluster_;
+    }
+
+    uint8_t *Cluster(uint32_t cluster_number) const {
+        uint64_t index = cluster_number - 2;
+        if constexpr (kShift)
+            return data_ + (index << kClusterShift);
+        return data_ + index * bytes_per_cluster_;
+    }
+
+    // the bytes of `cluster_count` clusters from `start_cluster` on
+    std::span<uint8_t> BytesOf(uint32_t start_cluster,
+                               uint32_t cluster_count) const {
+        if constexpr (kShift)
+            return {Cluster(start_cluster), uint64_t{cluster_count}
+                                                << kClusterShift};
+        return {Cluster(start_cluster),
+                uint64_t{cluster_count} * bytes_per_cluster_};
+    }
+
+    // the cluster, counted from the start of the directory, that holds
+    // `slot`, and the slot's place in it
+    uint32_t ClusterOfSlot(uint32_t slot) const {
+        if constexpr (kShift)
+            return slot >> (kClusterShift - kSlotShift);
+        return slot / (bytes_per_cluster_ >> kSlotShift);
+    }
+
+    uint32_t SlotInCluster(uint32_t slot) const {
+        if constexpr (kShift)
+            return slot & ((1u << (kClusterShift - kSlotShift)) - 1);
+        return slot % (bytes_per_cluster_ >> kSlotShift);
+    }
+};
+
+using AnyGeometry =
+    std::variant<Geometry<9>, Geometry<10>, Geometry<11>, Geometry<12>,
+                 Geometry<13>, Geometry<14>, Geometry<15>, Geometry<16>,
+                 Geometry<0>>;
+
+// the geometry for clusters of `bytes_per_cluster` bytes from `data` on
+inline AnyGeometry MakeGeometry(uint8_t *data, uint32_t bytes_per_cluster) {
+    switch (bytes_per_cluster) {
+    case 1u << 9:
+        return Geometry<9>(data, bytes_per_cluster);
+    case 1u << 10:
+        return Geometry<10>(data, bytes_per_cluster);
+    case 1u << 11:
+        return Geometry<11>(data, bytes_per_cluster);
+    case 1u << 12:
+        return Geometry<12>(data, bytes_per_cluster);
+    case 1u << 13:
+        return Geometry<13>(data, bytes_per_cluster);
+    case 1u << 14:
+        return Geometry<14>(data, bytes_per_cluster);
+    case 1u << 15:
+        return Geometry<15>(data, bytes_per_cluster);
+    case 1u << 16:
+        return Geometry<16>(data, bytes_per_cluster);
+    default:
+        return Geometry<0>(data, bytes_per_cluster);
+    }
+}
+
+} // namespace cs5250
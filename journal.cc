@@ -0,0 +1,153 @@
+#include "journal.h"
+#include "dir_index.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace cs5250 {
+
+static bool WriteFully(int fd, const uint8_t *data, size_t size,
+                       off_t offset) {
+    while (size > 0) {
+        auto written = pwrite(fd, data, size, offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return false;
+        data += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+static uint64_t HashRecord(const JournalRecord &record, uint64_t hash) {
+    return HashBytes(reinterpret_cast<const uint8_t *>(&record),
+                     sizeof(record), hash);
+}
+
+Journal::~Journal() { close(fd_); }
+
+bool Journal::Replay(const std::string &path, int image_fd) {
+    int fd = open(path.c_str(), O_RDWR);
+    if (fd < 0)
+        return errno == ENOENT;
+
+    struct stat journal_stat;
+    if (fstat(fd, &journal_stat) == -1) {
+        close(fd);
+        return false;
+    }
+    std::vector<uint8_t> journal(journal_stat.st_size);
+    size_t size = 0;
+    while (size < journal.size()) {
+        auto size_read = pread(fd, journal.data() + size,
+                               journal.size() - size, size);
+        if (size_read < 0 && errno == EINTR)
+            continue;
+        if (size_read <= 0)
+            break;
+        size += size_read;
+    }
+
+    // a transaction counts once its commit record is there and matches;
+    // a torn tail is dropped
+    std::vector<size_t> writes;
+    uint64_t hash = 0;
+    size_t position = 0;
+    auto ok = true;
+    while (ok && position + sizeof(JournalRecord) <= size) {
+        JournalRecord record;
+        memcpy(&record, journal.data() + position, sizeof(record));
+        if (record.magic != kJournalMagic)
+            break;
+
+        if (record.kind == kJournalWrite) {
+            if (record.length > size - position - sizeof(record))
+                break;
+            hash = HashRecord(record, hash);
+            hash = HashBytes(journal.data() + position + sizeof(record),
+                             record.length, hash);
+            writes.push_back(position);
+            position += sizeof(record) + record.length;
+        } else if (record.kind == kJournalCommit && record.hash == hash) {
+            for (auto write : writes) {
+                JournalRecord header;
+                memcpy(&header, journal.data() + write, sizeof(header));
+                ok = ok && WriteFully(image_fd,
+                                      journal.data() + write + sizeof(header),
+                                      header.length, header.offset);
+            }
+            writes.clear();
+            hash = 0;
+            position += sizeof(record);
+        } else {
+            break;
+        }
+    }
+
+    ok = ok && (position == 0 || fdatasync(image_fd) == 0);
+    ok = ok && ftruncate(fd, 0) == 0 && fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+std::unique_ptr<Journal> Journal::Open(const std::string &path, int image_fd,
+                                       const uint8_t *image) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+        return nullptr;
+    if (ftruncate(fd, 0) != 0) {
+        close(fd);
+        return nullptr;
+    }
+    return std::unique_ptr<Journal>(new Journal(fd, image_fd, image));
+}
+
+bool Journal::WriteRanges(const std::vector<ByteRange> &ranges) {
+    for (auto [begin, end] : ranges) {
+        if (!WriteFully(image_fd_, image_ + begin, end - begin, begin))
+            return false;
+    }
+    return true;
+}
+
+bool Journal::WriteData(const std::vector<ByteRange> &data) {
+    return WriteRanges(data);
+}
+
+bool Journal::Commit(const std::vector<ByteRange> &data,
+                     const std::vector<ByteRange> &metadata) {
+    if (!data.empty() && (!WriteRanges(data) || fdatasync(image_fd_) != 0))
+        return false;
+    if (metadata.empty())
+        return true;
+
+    std::vector<uint8_t> buffer;
+    uint64_t hash = 0;
+    for (auto [begin, end] : metadata) {
+        JournalRecord record = {kJournalMagic, kJournalWrite, begin,
+                                end - begin, 0};
+        hash = HashRecord(record, hash);
+        hash = HashBytes(image_ + begin, end - begin, hash);
+        auto record_bytes = reinterpret_cast<const uint8_t *>(&record);
+        buffer.insert(buffer.end(), record_bytes,
+                      record_bytes + sizeof(record));
+        buffer.insert(buffer.end(), image_ + begin, image_ + end);
+    }
+    JournalRecord commit = {kJournalMagic, kJournalCommit, 0, 0, hash};
+    auto commit_bytes = reinterpret_cast<const uint8_t *>(&commit);
+    buffer.insert(buffer.end(), commit_bytes, commit_bytes + sizeof(commit));
+
+    // the journal is empty between commits, so a transaction always
+    // starts at its beginning; the truncation is synced too, or after a
+    // crash the transaction could be replayed over later changes
+    return WriteFully(fd_, buffer.data(), buffer.size(), 0) &&
+           fsync(fd_) == 0 && WriteRanges(metadata) &&
+           fdatasync(image_fd_) == 0 && ftruncate(fd_, 0) == 0 &&
+           fsync(fd_) == 0;
+}
+
+} // namespace cs5250
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "dirty_ranges.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cs5250 {
+
+/*
+ * Write-ahead journal (<image>.journal)
+ *
+ * With the journal on, the image is mapped privately and nothing reaches
+ * the file before a commit, which
+ *   1. writes file data to the image and syncs it; data only ever goes to
+ *      clusters that were free at the previous commit, so this is safe
+ *      ahead of the metadata that points at it;
+ *   2. appends every changed metadata range (FATs, FSInfo, directory
+ *      entries) with its bytes to the journal, then a commit record with a
+ *      hash of the transaction, and syncs the journal;
+ *   3. writes the same ranges to the image, syncs it and empties the
+ *      journal.
+ * Opening an image replays the complete transactions left in its journal,
+ * so after a crash the metadata is either all old or all new.
+ */
+struct JournalRecord {
+    uint32_t magic;
+    uint32_t kind;
+    // write: where the `length` bytes that follow go in the image
+    uint64_t offset;
+    uint64_t length;
+    // commit: hash of every record and byte of the transaction before it
+    uint64_t hash;
+} __attribute__((packed));
+
+static_assert(sizeof(JournalRecord) == 32);
+
+static inline constexpr uint32_t kJournalMagic = 0x4E524A46; // "FJRN"
+static inline constexpr uint32_t kJournalWrite = 1;
+static inline constexpr uint32_t kJournalCommit = 2;
+
+class Journal {
+  private:
+    int fd_;
+    int image_fd_;
+    const uint8_t *image_;
+
+    Journal(int fd, int image_fd, const uint8_t *image)
+        : fd_(fd), image_fd_(image_fd), image_(image) {}
+
+    bool WriteRanges(const std::vector<ByteRange> &ranges);
+
+  public:
+    ~Journal();
+
+    // applies the complete transactions in the journal at `path`, if there
+    // is one, to the image and empties it; false if that failed
+    static bool Replay(const std::string &path, int image_fd);
+
+    // the journal for the image mapped at `image`, empty; nullptr if it
+    // cannot be created
+    static std::unique_ptr<Journal> Open(const std::string &path, int image_fd,
+                                         const uint8_t *image);
+
+    // writes file data to the image ahead of a commit, without syncing
+    bool WriteData(const std::vector<ByteRange> &data);
+
+    // makes `data` and `metadata` durable in the three steps above
+    bool Commit(const std::vector<ByteRange> &data,
+                const std::vector<ByteRange> &metadata);
+};
+
+} // namespace cs5250
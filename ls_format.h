@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+
+namespace cs5250 {
+
+enum class LsFormat { Text, NDJson, Binary };
+
+/*
+ * ls --format=bin
+ *
+ * The output is records[] followed by names[] and a trailer, so it can be
+ * written as the tree is walked and still be used in place after mmap:
+ * read the trailer from the last 32 bytes, then index the records. Paths
+ * are absolute, without a trailing slash, and stored back to back in
+ * names[].
+ */
+struct LsRecord {
+    uint64_t path_offset;
+    uint32_t path_length;
+    uint32_t size;
+    uint32_t first_cluster;
+    uint32_t cluster_count;
+    uint32_t extent_count;
+    uint8_t is_dir;
+    // DIR_Attr of the entry
+    uint8_t attr;
+    uint16_t _;
+} __attribute__((packed));
+
+struct LsTrailer {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t record_count;
+    uint64_t names_size;
+} __attribute__((packed));
+
+static_assert(sizeof(LsRecord) == 32);
+static_assert(sizeof(LsTrailer) == 32);
+
+static inline constexpr char kLsMagic[8] = {'F', 'A', 'T', 'L',
+                                            'S', '\0', '\0', '\0'};
+static inline constexpr uint32_t kLsVersion = 1;
+
+} // namespace cs5250
@@ -1,67 +1,291 @@
 #include "fat_manager.h"
 #include <fcntl.h>
+#include <fstream>
 #include <iostream>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 
-int main(int argc, char *argv[]) {
-    setbuf(stdout, NULL);
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s [path] [command]\n", argv[0]);
-        exit(1);
+using cs5250::FATError;
+using cs5250::FATManager;
+using Options = std::unordered_map<std::string, std::string>;
+
+static std::optional<cs5250::AllocPolicy>
+ParseAllocPolicy(const std::string &name) {
+    using cs5250::AllocPolicy;
+    if (name == "first")
+        return AllocPolicy::First;
+    if (name == "contig")
+        return AllocPolicy::Contig;
+    if (name == "best")
+        return AllocPolicy::Best;
+    return std::nullopt;
+}
+
+static std::optional<cs5250::SyncMode>
+ParseSyncMode(const std::string &name) {
+    using cs5250::SyncMode;
+    if (name == "none")
+        return SyncMode::None;
+    if (name == "end")
+        return SyncMode::End;
+    if (name == "op")
+        return SyncMode::Op;
+    return std::nullopt;
+}
+
+// --threads=N, if given
+static std::optional<unsigned> ThreadsOf(const Options &options) {
+    if (!options.count("threads"))
+        return std::nullopt;
+    auto threads = atoi(options.at("threads").c_str());
+    if (threads < 1) {
+        throw FATError("--threads needs a positive number");
+    }
+    return threads;
+}
+
+// options such as --alloc=contig may appear anywhere among the words
+static std::vector<std::string>
+SplitOptions(const std::vector<std::string> &words, Options &options) {
+    std::vector<std::string> args;
+    for (auto &word : words) {
+        if (word.substr(0, 2) == "--") {
+            auto eq = word.find('=');
+            if (eq == std::string::npos)
+                options[word.substr(2)] = "";
+            else
+                options[word.substr(2, eq - 2)] = word.substr(eq + 1);
+        } else {
+            args.push_back(word);
+        }
     }
-    const char *diskimg = argv[1];
+    return args;
+}
 
-    using cs5250::FATManager;
-    auto file_path = std::string(diskimg);
-    FATManager mgr{file_path};
+// split a batch line into words; quotes keep spaces inside a word and a
+// backslash escapes the next character
+static std::vector<std::string> SplitCommandLine(const std::string &line) {
+    std::vector<std::string> words;
+    std::string word;
+    auto in_word = false;
+    char quote = 0;
 
-    auto command = std::string(argv[2]);
+    for (size_t i = 0; i < line.size(); i++) {
+        auto c = line[i];
+        if (c == '\\' && i + 1 < line.size() && quote != '\'') {
+            word += line[++i];
+            in_word = true;
+        } else if (quote != 0) {
+            if (c == quote)
+                quote = 0;
+            else
+                word += c;
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            in_word = true;
+        } else if (c == ' ' || c == '\t') {
+            if (in_word)
+                words.push_back(std::move(word));
+            word.clear();
+            in_word = false;
+        } else {
+            word += c;
+            in_word = true;
+        }
+    }
+    if (quote != 0)
+        throw FATError("unterminated quote");
+    if (in_word)
+        words.push_back(std::move(word));
+    return words;
+}
+
+// `args` starts at the command name; `usage` is what precedes it when the
+// command is typed, e.g. "fat disk.img"
+static void RunCommand(FATManager &mgr, const std::string &usage,
+                       const std::vector<std::string> &args,
+                       const Options &options) {
+    auto &command = args[0];
+    auto cp_usage = "Usage: " + usage + "cp local:[path] image:[path] or " +
+                    usage + "cp image:[path] local:[path]";
+
+    auto policy = cs5250::AllocPolicy::First;
+    if (options.count("alloc")) {
+        auto parsed = ParseAllocPolicy(options.at("alloc"));
+        if (!parsed) {
+            throw FATError("Unknown allocation policy: " +
+                           options.at("alloc") + " (first, contig or best)");
+        }
+        policy = parsed.value();
+    }
+
+    if (auto threads = ThreadsOf(options)) {
+        mgr.SetScanThreads(*threads);
+    }
 
     if (command == "ck") {
         mgr.Ck();
     } else if (command == "ls") {
-        mgr.Ls();
+        std::optional<uint32_t> max_depth;
+        if (options.count("max-depth")) {
+            auto depth = atoi(options.at("max-depth").c_str());
+            if (depth < 1) {
+                throw FATError("--max-depth needs a positive number");
+            }
+            max_depth = depth;
+        }
+        auto format = cs5250::LsFormat::Text;
+        if (options.count("format")) {
+            auto &name = options.at("format");
+            if (name == "ndjson")
+                format = cs5250::LsFormat::NDJson;
+            else if (name == "bin")
+                format = cs5250::LsFormat::Binary;
+            else if (name != "text")
+                throw FATError("Unknown format: " + name +
+                               " (text, ndjson or bin)");
+        }
+        mgr.Ls(args.size() > 1 ? args[1] : "/", max_depth, format);
     } else if (command == "cp") {
-        if (argc < 5) {
-            fprintf(stderr,
-                    "Usage: %s %s %s local:[path] image:[path] or %s %s %s "
-                    "image:[path] local:[path]\n",
-                    argv[0], argv[1], argv[2], argv[0], argv[1], argv[2]);
-            exit(1);
+        if (args.size() < 3) {
+            throw FATError(cp_usage);
         }
-        // argv[3] or argv[4] should be in the format of "image:/path/to/file"
+        // args[1] or args[2] should be in the format of "image:/path/to/file"
         // and "local:/path/to/file" try to read the first 6 characters
-        auto src = std::string(argv[3]);
-        auto dst = std::string(argv[4]);
+        auto src = args[1];
+        auto dst = args[2] == "-" ? "local:-" : args[2];
 
         if (src.substr(0, 6) == "image:" && dst.substr(0, 6) == "local:") {
             mgr.CopyFileTo(src.substr(6), dst.substr(6));
         } else if (src.substr(0, 6) == "local:" &&
                    dst.substr(0, 6) == "image:") {
-            mgr.CopyFileFrom(src.substr(6), dst.substr(6));
+            mgr.CopyFileFrom(src.substr(6), dst.substr(6), policy);
         } else {
-            fprintf(stderr,
-                    "Usage: %s %s %s local:[path] image:[path] or %s %s %s "
-                    "image:[path] local:[path]\n",
-                    argv[0], argv[1], argv[2], argv[0], argv[1], argv[2]);
-            exit(1);
+            throw FATError(cp_usage);
         }
 
     } else if (command == "rm") {
-        if (argc < 4) {
-            fprintf(stderr, "Usage: %s %s %s [path]\n", argv[0], argv[1],
-                    argv[2]);
-            exit(1);
+        if (args.size() < 2) {
+            throw FATError("Usage: " + usage + "rm [path]...");
         }
-        auto path = std::string(argv[3]);
-        mgr.Delete(path);
+        mgr.Delete(std::vector<std::string>(args.begin() + 1, args.end()));
+    } else if (command == "index") {
+        mgr.Index();
     } else {
-        std::cerr << "Unknown command: " << command << std::endl;
+        throw FATError("Unknown command: " + command);
+    }
+}
+
+// Runs one command per line against the same FATManager. A failed command
+// is reported and the batch moves on; the result is 1 if any failed. The
+// options of a line apply to it alone, over those of the batch itself.
+static int RunBatch(FATManager &mgr, std::istream &in, bool interactive,
+                    const Options &defaults) {
+    auto scan_threads = mgr.ScanThreads();
+    auto failed = false;
+    std::string line;
+    size_t line_number = 0;
+
+    while (true) {
+        if (interactive) {
+            std::cout << "fat> " << std::flush;
+        }
+        if (!std::getline(in, line)) {
+            break;
+        }
+        line_number++;
+
+        try {
+            auto options = defaults;
+            auto args = SplitOptions(SplitCommandLine(line), options);
+            if (args.empty() || args[0][0] == '#') {
+                continue;
+            }
+            if (args[0] == "quit" || args[0] == "exit") {
+                break;
+            }
+            if (args[0] == "batch" || args[0] == "shell") {
+                throw FATError("batches cannot be nested");
+            }
+            RunCommand(mgr, "", args, options);
+        } catch (const FATError &e) {
+            failed = true;
+            if (interactive)
+                std::cerr << e.what() << std::endl;
+            else
+                std::cerr << "line " << line_number << ": " << e.what()
+                          << std::endl;
+        }
+        mgr.SetScanThreads(scan_threads);
+    }
+    if (interactive) {
+        std::cout << std::endl;
+    }
+    // with --journal or --sync=end, the whole batch is committed with one
+    // sync
+    try {
+        mgr.Commit();
+    } catch (const FATError &e) {
+        failed = true;
+        std::cerr << e.what() << std::endl;
+    }
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    auto args = SplitOptions(std::vector<std::string>(argv + 1, argv + argc),
+                             options);
+
+    if (args.size() < 2) {
+        fprintf(stderr, "Usage: %s [path] [command]\n", argv[0]);
+        exit(1);
+    }
+
+    try {
+        auto file_path = args[0];
+        FATManager mgr{file_path, options.count("journal") > 0};
+        mgr.SetScanThreads(
+            ThreadsOf(options).value_or(std::thread::hardware_concurrency()));
+        if (options.count("sync")) {
+            auto mode = ParseSyncMode(options.at("sync"));
+            if (!mode) {
+                throw FATError("Unknown sync mode: " + options.at("sync") +
+                               " (none, end or op)");
+            }
+            mgr.SetSyncMode(mode.value());
+        }
+        if (options.count("no-mirror-sync")) {
+            mgr.SetMirrorSync(false);
+        }
+
+        auto command = std::vector<std::string>(args.begin() + 1, args.end());
+
+        // batch [file] runs commands from the file or stdin, shell prompts
+        // for them
+        if (command[0] == "batch" || command[0] == "shell") {
+            auto interactive = command[0] == "shell";
+            if (command.size() > 1) {
+                std::ifstream in(command[1]);
+                if (!in.is_open()) {
+                    throw FATError("failed to open file " + command[1]);
+                }
+                return RunBatch(mgr, in, false, options);
+            }
+            return RunBatch(mgr, std::cin, interactive, options);
+        }
+
+        RunCommand(mgr, std::string(argv[0]) + " " + file_path + " ", command,
+                   options);
+        mgr.Commit();
+    } catch (const FATError &e) {
+        std::cerr << e.what() << std::endl;
         exit(1);
     }
 }
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdlib>
+#include <iostream>
+
+// Checks for the test programs. A failed check is reported with its line
+// and the program carries on; TestExit() makes it fail at the end.
+namespace cs5250::test {
+
+inline int failures = 0;
+
+inline int TestExit() {
+    if (failures > 0)
+        std::cerr << failures << " check(s) failed" << std::endl;
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+} // namespace cs5250::test
+
+#define CHECK(x)                                                               \
+    do {                                                                       \
+        if (!(x)) {                                                            \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #x ")"      \
+                      << std::endl;                                            \
+            cs5250::test::failures++;                                          \
+        }                                                                      \
+    } while (0)
+
+#define CHECK_EQ(x, y)                                                         \
+    do {                                                                       \
+        auto &&x_ = (x);                                                       \
+        auto &&y_ = (y);                                                       \
+        if (!(x_ == y_)) {                                                     \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #x       \
+                      << ", " #y "): " << x_ << " != " << y_ << std::endl;     \
+            cs5250::test::failures++;                                          \
+        }                                                                      \
+    } while (0)
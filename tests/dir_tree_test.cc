@@ -0,0 +1,90 @@
+#include "check.h"
+#include "dir_tree.h"
+#include <string>
+
+using namespace cs5250;
+
+namespace {
+
+// a name beats an alias, and among equal aliases the first one added wins
+void AliasesResolveAfterNames() {
+    DirTree tree;
+    tree.Reset(2);
+    auto dir = tree.Add(DirTree::kRoot, "dir", 3, 0, 0x10, 0, 1);
+    auto first = tree.Add(dir, "first long name", 4, 0, 0, 0, 2, "FIRST~1");
+    auto second = tree.Add(dir, "second long name", 5, 0, 0, 2, 2, "FIRST~1");
+    auto named = tree.Add(dir, "FIRST~1", 6, 0, 0, 4, 1);
+
+    CHECK_EQ(tree.Find(dir, "first long name"), first);
+    CHECK_EQ(tree.Find(dir, "first~1"), named);
+    CHECK_EQ(tree.AliasOf(second), "FIRST~1");
+    CHECK(tree.AliasOf(named).empty());
+    CHECK_EQ(tree.Find(DirTree::kRoot, "FIRST~1"), kNoNode);
+
+    tree.Remove(named);
+    CHECK_EQ(tree.Find(dir, "FIRST~1"), first);
+    tree.Remove(first);
+    CHECK_EQ(tree.Find(dir, "FIRST~1"), second);
+    tree.Remove(second);
+    CHECK_EQ(tree.Find(dir, "FIRST~1"), kNoNode);
+}
+
+// many files sharing one alias, as the tool writes them, through the
+// rehashes of a growing tree and a removal from the middle of the chain
+void SharedAliasesSurviveRehash() {
+    DirTree tree;
+    tree.Reset(2);
+    const uint32_t count = 1000;
+    for (uint32_t i = 0; i < count; i++) {
+        auto name = "file number " + std::to_string(i);
+        tree.Add(DirTree::kRoot, name, i + 3, 0, 0, 2 * i, 2, "AAAAAAAA.AAA");
+    }
+    CHECK_EQ(tree.Find(DirTree::kRoot, "aaaaaaaa.aaa"), 1u);
+    CHECK_EQ(tree.Find(DirTree::kRoot, "file number 999"), count);
+
+    tree.Remove(500);
+    tree.Remove(1);
+    CHECK_EQ(tree.Find(DirTree::kRoot, "AAAAAAAA.AAA"), 2u);
+    CHECK_EQ(tree.Find(DirTree::kRoot, "file number 499"), kNoNode);
+}
+
+// a node put in slots freed by a removal is listed where a fresh read of
+// the directory would find it, not after the last child
+void ChildrenStayInSlotOrder() {
+    DirTree tree;
+    tree.Reset(2);
+    tree.Add(DirTree::kRoot, "a", 3, 0, 0, 0, 2);
+    auto b = tree.Add(DirTree::kRoot, "b", 4, 0, 0, 2, 2);
+    tree.Add(DirTree::kRoot, "c", 5, 0, 0, 4, 2);
+    auto d = tree.Add(DirTree::kRoot, "d", 6, 0, 0, 6, 2);
+    tree.Remove(d);
+    tree.Remove(b);
+    tree.Add(DirTree::kRoot, "e", 7, 0, 0, 2, 2);
+    tree.Add(DirTree::kRoot, "f", 8, 0, 0, 7, 1);
+    tree.Add(DirTree::kRoot, "g", 9, 0, 0, 6, 1);
+
+    auto listed = [&] {
+        std::string names;
+        for (auto child = tree.FirstChild(DirTree::kRoot); child != kNoNode;
+             child = tree.NextSibling(child))
+            names += tree.NameOf(child);
+        return names;
+    };
+    CHECK_EQ(listed(), "aecgf");
+
+    tree.Remove(tree.Find(DirTree::kRoot, "a"));
+    tree.Add(DirTree::kRoot, "h", 10, 0, 0, 0, 1);
+    CHECK_EQ(listed(), "hecgf");
+    tree.Remove(tree.Find(DirTree::kRoot, "f"));
+    tree.Add(DirTree::kRoot, "i", 11, 0, 0, 8, 1);
+    CHECK_EQ(listed(), "hecgi");
+}
+
+} // namespace
+
+int main() {
+    AliasesResolveAfterNames();
+    SharedAliasesSurviveRehash();
+    ChildrenStayInSlotOrder();
+    return test::TestExit();
+}
@@ -0,0 +1,227 @@
+#include "check.h"
+#include "fat_manager.h"
+#include "test_image.h"
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+
+using namespace cs5250;
+using namespace cs5250::test;
+
+namespace {
+
+// a directory opens fine but cannot be read, so the copy fails after its
+// clusters have been claimed; they must all come back
+void FailedCopyGivesTheClustersBack() {
+    char source[] = "/tmp/fat_test_dir_XXXXXX";
+    CHECK(mkdtemp(source) != nullptr);
+
+    for (auto journal : {false, true}) {
+        TestImage image;
+        {
+            FATManager mgr(image.Path(), journal);
+            auto failed = false;
+            try {
+                mgr.CopyFileFrom(source, "/x");
+            } catch (const FATError &) {
+                failed = true;
+            }
+            CHECK(failed);
+        }
+        auto fsck = image.Fsck();
+        CHECK_EQ(fsck.fsinfo_free, TestImage::kClusters - 1);
+        CHECK(fsck.Clean());
+    }
+    rmdir(source);
+}
+
+std::string TempPath() {
+    char path[] = "/tmp/fat_test_file_XXXXXX";
+    close(mkstemp(path));
+    return path;
+}
+
+std::string ReadAll(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+}
+
+// gives the first file of the root the short name `name` (8 + 3 bytes,
+// space padded) and fixes up the checksums of its long name entries
+void RenameShortEntry(const TestImage &image, const char (&name)[12]) {
+    auto fd = open(image.Path().c_str(), O_RDWR);
+    FATDirectory entries[16];
+    pread(fd, entries, sizeof(entries), TestImage::ClusterOffset(2));
+    auto slot = 0;
+    while (entries[slot].DIR_Attr == 0x0F)
+        slot++;
+    memcpy(&entries[slot].DIR_Name, name, 11);
+
+    uint8_t sum = 0;
+    for (auto c : std::string_view(name, 11))
+        sum = ((sum & 1) << 7) + (sum >> 1) + static_cast<uint8_t>(c);
+    for (auto i = 0; i < slot; i++)
+        reinterpret_cast<LongNameDirectory &>(entries[i]).LDIR_Chksum = sum;
+    pwrite(fd, entries, sizeof(entries), TestImage::ClusterOffset(2));
+    close(fd);
+}
+
+// a file with a long name can also be reached by its 8.3 name, whether
+// the directory is read on demand, by a tree scan or from the index
+void ShortNameFindsLongNamedFile() {
+    TestImage image;
+    auto source = TempPath();
+    auto copy = TempPath();
+    std::ofstream(source) << "contents";
+    {
+        FATManager mgr(image.Path());
+        mgr.CopyFileFrom(source, "/longfilename.bin");
+    }
+    RenameShortEntry(image, "LONGFI~1BIN");
+
+    auto reads_back = [&](FATManager &mgr, const std::string &path) {
+        std::remove(copy.c_str());
+        try {
+            mgr.CopyFileTo(path, copy);
+        } catch (const FATError &) {
+            return false;
+        }
+        return ReadAll(copy) == "contents";
+    };
+    {
+        FATManager mgr(image.Path());
+        CHECK(reads_back(mgr, "/LONGFI~1.BIN"));
+        CHECK(reads_back(mgr, "/longfi~1.bin"));
+        CHECK(reads_back(mgr, "/longfilename.bin"));
+        CHECK(!reads_back(mgr, "/LONGFI~2.BIN"));
+    }
+    {
+        FATManager mgr(image.Path());
+        mgr.SetScanThreads(2);
+        mgr.Index();
+        CHECK(reads_back(mgr, "/LONGFI~1.BIN"));
+    }
+    {
+        FATManager mgr(image.Path());
+        CHECK(reads_back(mgr, "/LONGFI~1.BIN"));
+        CHECK(reads_back(mgr, "/longfilename.bin"));
+    }
+    std::remove(source.c_str());
+    std::remove(copy.c_str());
+}
+
+// a file written after a delete goes into the slots the delete freed
+// rather than after the last entry
+void DeletedSlotsAreReused() {
+    TestImage image;
+    auto source = TempPath();
+    std::ofstream(source) << "contents";
+    {
+        FATManager mgr(image.Path());
+        // 13 to 26 characters: two long name entries and the short one
+        mgr.CopyFileFrom(source, "/first file name.txt");
+        mgr.CopyFileFrom(source, "/second file name.txt");
+        mgr.CopyFileFrom(source, "/third file name.txt");
+        mgr.Delete({"/second file name.txt"});
+        mgr.CopyFileFrom(source, "/fourth file name.txt");
+    }
+    FATDirectory entries[16];
+    auto fd = open(image.Path().c_str(), O_RDONLY);
+    pread(fd, entries, sizeof(entries), TestImage::ClusterOffset(2));
+    close(fd);
+    for (auto slot = 0; slot < 9; slot++)
+        CHECK(entries[slot].DIR_Name.name[0] != 0xE5);
+    CHECK_EQ(entries[9].DIR_Name.name[0], 0);
+    CHECK(image.Fsck().Clean());
+    std::remove(source.c_str());
+}
+
+// a copy onto the name of a directory fails instead of adding a file of
+// the same name next to it
+void CopyOntoDirectoryFails() {
+    TestImage image;
+    image.AddDirectory(2, "D          ");
+    auto source = TempPath();
+    std::ofstream(source) << "contents";
+    {
+        FATManager mgr(image.Path());
+        for (auto dest : {"/D", "/d"}) {
+            auto failed = false;
+            try {
+                mgr.CopyFileFrom(source, dest);
+            } catch (const FATError &) {
+                failed = true;
+            }
+            CHECK(failed);
+        }
+    }
+    FATDirectory entries[16];
+    auto fd = open(image.Path().c_str(), O_RDONLY);
+    pread(fd, entries, sizeof(entries), TestImage::ClusterOffset(2));
+    close(fd);
+    CHECK_EQ(entries[1].DIR_Name.name[0], 0);
+    CHECK_EQ(image.Fsck().fsinfo_free, TestImage::kClusters - 2);
+    CHECK(image.Fsck().Clean());
+    std::remove(source.c_str());
+}
+
+// under --sync=op an empty file is committed as soon as it is copied,
+// like any other
+void EmptyCopyIsCommitted() {
+    TestImage image;
+    auto source = TempPath();
+    FATManager mgr(image.Path(), true);
+    mgr.SetSyncMode(SyncMode::Op);
+    mgr.CopyFileFrom(source, "/empty");
+
+    // the journal keeps the image mapped privately, so the entry is only
+    // in the file once committed
+    FATDirectory entries[16];
+    auto fd = open(image.Path().c_str(), O_RDONLY);
+    pread(fd, entries, sizeof(entries), TestImage::ClusterOffset(2));
+    close(fd);
+    CHECK_EQ(entries[0].DIR_Attr, 0x0F);
+    CHECK(entries[1].DIR_Name.name[0] != 0);
+    std::remove(source.c_str());
+}
+
+// a directory that points back at the root is read once by a whole-tree
+// walk, single-threaded or not, and can still be entered by path
+void DirectoryLoopEnds() {
+    TestImage image;
+    auto source = TempPath();
+    auto copy = TempPath();
+    std::ofstream(source) << "contents";
+    {
+        FATManager mgr(image.Path());
+        mgr.CopyFileFrom(source, "/x");
+    }
+    auto d = image.AddDirectory(2, "D          ");
+    image.AddDirectory(d, "LOOP       ", 2);
+
+    for (auto threads : {1u, 2u}) {
+        {
+            FATManager mgr(image.Path());
+            mgr.SetScanThreads(threads);
+            mgr.Index();
+        }
+        FATManager mgr(image.Path());
+        mgr.CopyFileTo("/D/LOOP/D/LOOP/x", copy);
+        CHECK_EQ(ReadAll(copy), "contents");
+    }
+    std::remove(source.c_str());
+    std::remove(copy.c_str());
+}
+
+} // namespace
+
+int main() {
+    FailedCopyGivesTheClustersBack();
+    ShortNameFindsLongNamedFile();
+    DeletedSlotsAreReused();
+    CopyOntoDirectoryFails();
+    EmptyCopyIsCommitted();
+    DirectoryLoopEnds();
+    return TestExit();
+}
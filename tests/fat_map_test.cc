@@ -0,0 +1,107 @@
+#include "check.h"
+#include "fat_map.h"
+#include <vector>
+
+using namespace cs5250;
+
+namespace {
+
+// a single FAT32 of `cluster_end` entries with every cluster in use except
+// those in [free_begin, free_end)
+struct FAT32Fixture {
+    std::vector<uint32_t> entries;
+
+    FAT32Fixture(uint32_t cluster_end, uint32_t free_begin, uint32_t free_end)
+        : entries(cluster_end, FAT32Entry::kEndMark) {
+        for (auto c = free_begin; c < free_end; c++)
+            entries[c] = 0;
+    }
+
+    FATMap<FAT32Entry> Map(uint32_t next_free_hint) {
+        auto fat = reinterpret_cast<uint8_t *>(entries.data());
+        return FATMap<FAT32Entry>(1, entries.size() * sizeof(uint32_t), {fat},
+                                  entries.size(), next_free_hint);
+    }
+};
+
+bool IsOneRun(const std::vector<uint32_t> &clusters, uint32_t start) {
+    for (size_t i = 0; i < clusters.size(); i++) {
+        if (clusters[i] != start + i)
+            return false;
+    }
+    return true;
+}
+
+// a hint inside a free run must not cut it in two; cut at the hint,
+// neither half holds the file and the fallback would pair one of them
+// with the 60-cluster run further on
+void ContigTakesTheRunHoldingTheHint() {
+    FAT32Fixture fixture(300, 3, 103);
+    for (auto c = 150; c < 210; c++)
+        fixture.entries[c] = 0;
+    for (auto policy : {AllocPolicy::Contig, AllocPolicy::Best}) {
+        auto map = fixture.Map(53);
+        auto clusters = map.FindFree(80, policy);
+        CHECK(clusters.has_value());
+        CHECK_EQ(clusters->size(), 80u);
+        CHECK(IsOneRun(*clusters, 3));
+    }
+}
+
+// with the hint at a run boundary the scan still starts there
+void ContigStartsAtTheHint() {
+    FAT32Fixture fixture(300, 3, 103);
+    for (auto c = 150; c < 250; c++)
+        fixture.entries[c] = 0;
+    auto map = fixture.Map(150);
+    auto clusters = map.FindFree(60, AllocPolicy::Contig);
+    CHECK(clusters.has_value());
+    CHECK(IsOneRun(*clusters, 150));
+}
+
+// a chain whose last entry links past the FAT gives a run that stops at
+// the last cluster, whatever the width of the entries; the starts cover
+// every position of a run within the vector kernels' blocks
+void RunStopsAtTheEndOfTheFAT() {
+    const uint32_t cluster_end = 100;
+    FAT32Fixture fixture(cluster_end, 0, 0);
+    std::vector<uint16_t> entries16(cluster_end, FAT16Entry::kEndMark);
+    for (auto c = 2u; c < cluster_end; c++) {
+        fixture.entries[c] = c + 1;
+        entries16[c] = c + 1;
+    }
+    auto map = fixture.Map(2);
+    auto fat16 = reinterpret_cast<uint8_t *>(entries16.data());
+    FATMap<FAT16Entry> map16(1, entries16.size() * sizeof(uint16_t), {fat16},
+                             cluster_end, 2);
+    for (auto start = 2u; start < cluster_end; start++) {
+        CHECK_EQ(map.RunLength(start), cluster_end - start);
+        CHECK_EQ(map16.RunLength(start), cluster_end - start);
+    }
+}
+
+// clusters freed during a transaction are zero in the FAT but are not
+// handed out again until the commit
+void RecountSeesHeldFrees() {
+    FAT32Fixture fixture(200, 3, 103);
+    auto map = fixture.Map(3);
+    map.HoldFrees(true);
+    CHECK_EQ(map.FreeCount(), 100u);
+    map.SetFree(150);
+    map.SetFree(151);
+    CHECK_EQ(map.CountFree(), 102u);
+    CHECK_EQ(map.FreeCount(), 100u);
+    map.ReleaseFrees();
+    CHECK_EQ(map.CountFree(), 102u);
+    CHECK_EQ(map.FreeCount(), 102u);
+}
+
+} // namespace
+
+int main() {
+    ContigTakesTheRunHoldingTheHint();
+    ContigStartsAtTheHint();
+    RunStopsAtTheEndOfTheFAT();
+    RecountSeesHeldFrees();
+    return test::TestExit();
+}
@@ -0,0 +1,55 @@
+#include "check.h"
+#include "free_slots.h"
+
+using namespace cs5250;
+
+namespace {
+
+// the smallest run that holds the entries is used, the earliest of equals
+void TakesTheBestFit() {
+    FreeSlots slots(64);
+    slots.Release(4, 6);
+    slots.Release(20, 3);
+    slots.Release(30, 3);
+    slots.Release(40, 10);
+
+    CHECK_EQ(slots.Take(3).value_or(-1), 20u);
+    CHECK_EQ(slots.Take(3).value_or(-1), 30u);
+    CHECK_EQ(slots.Take(4).value_or(-1), 4u);
+    // what is left of the first run is [8, 10)
+    CHECK_EQ(slots.Take(2).value_or(-1), 8u);
+    CHECK(!slots.Take(11).has_value());
+}
+
+// freed slots join the runs on either side, so a hole left by a delete
+// takes a long name as big as the entries around it
+void ReleaseMergesNeighbours() {
+    FreeSlots slots(32);
+    slots.Release(0, 4);
+    slots.Release(8, 4);
+    slots.Release(4, 4);
+    CHECK_EQ(slots.Take(12).value_or(-1), 0u);
+    CHECK(!slots.Take(1).has_value());
+}
+
+// a directory grows only when no run fits, and the new cluster joins a
+// free run at its old end
+void GrowExtendsTheLastRun() {
+    FreeSlots slots(16);
+    slots.Release(14, 2);
+    CHECK(!slots.Take(5).has_value());
+    slots.Grow(16);
+    CHECK_EQ(slots.Capacity(), 32u);
+    CHECK_EQ(slots.Take(5).value_or(-1), 14u);
+    CHECK_EQ(slots.Take(13).value_or(-1), 19u);
+    CHECK(!slots.Take(1).has_value());
+}
+
+} // namespace
+
+int main() {
+    TakesTheBestFit();
+    ReleaseMergesNeighbours();
+    GrowExtendsTheLastRun();
+    return test::TestExit();
+}
@@ -0,0 +1,157 @@
+#include "check.h"
+#include "dir_index.h"
+#include "journal.h"
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace cs5250;
+
+namespace {
+
+// an image of zeros and the path its journal goes to
+struct Files {
+    std::string image;
+    std::string journal;
+    int image_fd;
+
+    Files() {
+        char path[] = "/tmp/fat_test_journal_XXXXXX";
+        image_fd = mkstemp(path);
+        image = path;
+        journal = image + ".journal";
+        CHECK(ftruncate(image_fd, 4096) == 0);
+    }
+
+    ~Files() {
+        close(image_fd);
+        unlink(image.c_str());
+        unlink(journal.c_str());
+    }
+
+    std::string ImageBytes(off_t offset, size_t size) const {
+        std::string bytes(size, '\0');
+        CHECK(pread(image_fd, bytes.data(), size, offset) == ssize_t(size));
+        return bytes;
+    }
+
+    off_t JournalSize() const {
+        struct stat journal_stat;
+        return stat(journal.c_str(), &journal_stat) == 0 ? journal_stat.st_size
+                                                         : -1;
+    }
+};
+
+// builds journal contents the way Journal::Commit lays them out
+class Transaction {
+  private:
+    std::vector<uint8_t> bytes_;
+    uint64_t hash_ = 0;
+
+    void Append(const void *data, size_t size) {
+        auto p = static_cast<const uint8_t *>(data);
+        bytes_.insert(bytes_.end(), p, p + size);
+    }
+
+  public:
+    Transaction &Write(uint64_t offset, const std::string &data) {
+        JournalRecord record = {kJournalMagic, kJournalWrite, offset,
+                                data.size(), 0};
+        hash_ = HashBytes(reinterpret_cast<const uint8_t *>(&record),
+                          sizeof(record), hash_);
+        hash_ = HashBytes(reinterpret_cast<const uint8_t *>(data.data()),
+                          data.size(), hash_);
+        Append(&record, sizeof(record));
+        Append(data.data(), data.size());
+        return *this;
+    }
+
+    // `hash_delta` other than 0 makes the commit record not match
+    std::vector<uint8_t> Commit(uint64_t hash_delta = 0) {
+        JournalRecord commit = {kJournalMagic, kJournalCommit, 0, 0,
+                                hash_ + hash_delta};
+        Append(&commit, sizeof(commit));
+        return bytes_;
+    }
+
+    std::vector<uint8_t> Torn() const { return bytes_; }
+};
+
+void WriteJournal(const Files &files,
+                  const std::vector<std::vector<uint8_t>> &parts) {
+    auto fd = open(files.journal.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (auto &part : parts)
+        CHECK(write(fd, part.data(), part.size()) == ssize_t(part.size()));
+    close(fd);
+}
+
+// complete transactions are applied in order and the journal emptied
+void ReplayAppliesCommittedTransactions() {
+    Files files;
+    WriteJournal(files, {Transaction().Write(100, "abcd").Commit(),
+                         Transaction().Write(102, "XY").Write(300, "e")
+                             .Commit()});
+    CHECK(Journal::Replay(files.journal, files.image_fd));
+    CHECK_EQ(files.ImageBytes(100, 4), "abXY");
+    CHECK_EQ(files.ImageBytes(300, 1), "e");
+    CHECK_EQ(files.JournalSize(), 0);
+}
+
+// a transaction without its commit record, with a commit record that does
+// not match, or cut off inside a record is dropped with what follows
+void ReplayDropsTornTail() {
+    auto committed = Transaction().Write(100, "abcd").Commit();
+    auto cut = Transaction().Write(200, "wxyz").Commit();
+    cut.resize(sizeof(JournalRecord) + 2);
+    std::vector<std::vector<uint8_t>> tails = {
+        Transaction().Write(200, "wxyz").Torn(),
+        Transaction().Write(200, "wxyz").Commit(1),
+        cut,
+    };
+    for (auto &tail : tails) {
+        Files files;
+        WriteJournal(files, {committed, tail,
+                             Transaction().Write(300, "e").Commit()});
+        CHECK(Journal::Replay(files.journal, files.image_fd));
+        CHECK_EQ(files.ImageBytes(100, 4), "abcd");
+        CHECK_EQ(files.ImageBytes(200, 4), std::string(4, '\0'));
+        CHECK_EQ(files.ImageBytes(300, 1), std::string(1, '\0'));
+        CHECK_EQ(files.JournalSize(), 0);
+    }
+}
+
+// no journal at all is fine
+void ReplayWithoutJournal() {
+    Files files;
+    CHECK(Journal::Replay(files.journal, files.image_fd));
+    CHECK_EQ(files.JournalSize(), -1);
+}
+
+// a commit puts data and metadata in the image and leaves the journal
+// empty for the next transaction
+void CommitLeavesJournalEmpty() {
+    Files files;
+    std::vector<uint8_t> image(4096, 0);
+    memcpy(image.data() + 100, "data", 4);
+    memcpy(image.data() + 2000, "meta", 4);
+    auto journal = Journal::Open(files.journal, files.image_fd, image.data());
+    CHECK(journal != nullptr);
+    CHECK(journal->Commit({{100, 104}}, {{2000, 2004}}));
+    CHECK_EQ(files.ImageBytes(100, 4), "data");
+    CHECK_EQ(files.ImageBytes(2000, 4), "meta");
+    CHECK_EQ(files.JournalSize(), 0);
+}
+
+} // namespace
+
+int main() {
+    ReplayAppliesCommittedTransactions();
+    ReplayDropsTornTail();
+    ReplayWithoutJournal();
+    CommitLeavesJournalEmpty();
+    return test::TestExit();
+}
@@ -0,0 +1,238 @@
+#pragma once
+
+#include "fat.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// A small FAT32 image in a temporary file, and a check of its consistency
+// in the spirit of fsck.
+namespace cs5250::test {
+
+struct FsckResult {
+    // zero entries in FAT #0
+    uint32_t free_entries = 0;
+    // FSI_Free_Count
+    uint32_t fsinfo_free = 0;
+    // clusters in use that no entry reaches
+    uint32_t leaked = 0;
+    // clusters reached twice
+    uint32_t cross_linked = 0;
+    bool mirrors_match = true;
+
+    bool Clean() const {
+        return free_entries == fsinfo_free && leaked == 0 &&
+               cross_linked == 0 && mirrors_match;
+    }
+};
+
+class TestImage {
+  private:
+    static constexpr uint32_t kBytesPerSector = 512;
+    static constexpr uint32_t kReservedSectors = 32;
+    static constexpr uint32_t kEndOfChain = 0x0FFFFFFF;
+
+    std::string path_;
+
+    static uint32_t FATSectors(uint32_t clusters) {
+        return ((clusters + 2) * 4 + kBytesPerSector - 1) / kBytesPerSector;
+    }
+
+  public:
+    // FAT32 needs at least 65525 clusters; one sector each keeps the
+    // (sparse) file small
+    static constexpr uint32_t kClusters = 65600;
+
+    TestImage() {
+        char path[] = "/tmp/fat_test_XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            perror("mkstemp");
+            exit(EXIT_FAILURE);
+        }
+        path_ = path;
+
+        auto fat_sectors = FATSectors(kClusters);
+        auto total = kReservedSectors + 2 * fat_sectors + kClusters;
+
+        BPB bpb = {};
+        memcpy(bpb.BS_jmpBoot, "\xEB\x58\x90", 3);
+        memcpy(bpb.BS_OEMName, "MSWIN4.1", 8);
+        bpb.BPB_BytsPerSec = kBytesPerSector;
+        bpb.BPB_SecPerClus = 1;
+        bpb.BPB_RsvdSecCnt = kReservedSectors;
+        bpb.BPB_NumFATs = 2;
+        bpb.BPB_Media = 0xF8;
+        bpb.BPB_TotSec32 = total;
+        bpb.fat32.BPB_FATSz32 = fat_sectors;
+        bpb.fat32.BPB_RootClus = 2;
+        bpb.fat32.BPB_FSInfo = 1;
+        bpb.fat32.BPB_BkBootSec = 6;
+        bpb.fat32.BS_BootSig = 0x29;
+        memcpy(bpb.fat32.BS_FilSysType, "FAT32   ", 8);
+        bpb.Signature_word = 0xAA55;
+
+        FSInfo fs_info = {};
+        fs_info.FSI_LeadSig = 0x41615252;
+        fs_info.FSI_StrucSig = 0x61417272;
+        fs_info.FSI_Free_Count = kClusters - 1;
+        fs_info.FSI_Nxt_Free = 3;
+        fs_info.FSI_TrailSig = 0xAA550000;
+
+        // the root directory takes cluster 2
+        uint32_t fat_head[] = {0x0FFFFFF8, kEndOfChain, kEndOfChain};
+
+        auto ok = ftruncate(fd, off_t(total) * kBytesPerSector) == 0 &&
+                  pwrite(fd, &bpb, sizeof(bpb), 0) == sizeof(bpb) &&
+                  pwrite(fd, &fs_info, sizeof(fs_info), kBytesPerSector) ==
+                      sizeof(fs_info);
+        for (uint32_t i = 0; i < 2; i++) {
+            off_t fat = (kReservedSectors + i * fat_sectors) * kBytesPerSector;
+            ok = ok && pwrite(fd, fat_head, sizeof(fat_head), fat) ==
+                           sizeof(fat_head);
+        }
+        close(fd);
+        if (!ok) {
+            perror("writing the test image");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ~TestImage() {
+        unlink(path_.c_str());
+        unlink((path_ + ".journal").c_str());
+        unlink((path_ + ".fatidx").c_str());
+    }
+
+    const std::string &Path() const { return path_; }
+
+    // where `cluster` starts in the file
+    static off_t ClusterOffset(uint32_t cluster) {
+        return off_t(kReservedSectors + 2 * FATSectors(kClusters) + cluster -
+                     2) *
+               kBytesPerSector;
+    }
+
+    // adds the directory `name` (8 + 3 bytes, space padded) to the one at
+    // `parent`, in the first free slot of its first cluster, and returns
+    // its cluster; it gets a fresh empty cluster unless `first_cluster`
+    // names one
+    uint32_t AddDirectory(uint32_t parent, const char (&name)[12],
+                          uint32_t first_cluster = 0) const {
+        auto fd = open(path_.c_str(), O_RDWR);
+        auto fat_bytes = FATSectors(kClusters) * kBytesPerSector;
+        off_t fat = kReservedSectors * kBytesPerSector;
+
+        if (first_cluster == 0) {
+            uint32_t entry = 1;
+            for (first_cluster = 2; entry != 0;) {
+                first_cluster++;
+                pread(fd, &entry, 4, fat + first_cluster * 4);
+            }
+            for (uint32_t i = 0; i < 2; i++)
+                pwrite(fd, &kEndOfChain, 4,
+                       fat + i * fat_bytes + first_cluster * 4);
+
+            FSInfo fs_info;
+            pread(fd, &fs_info, sizeof(fs_info), kBytesPerSector);
+            fs_info.FSI_Free_Count--;
+            pwrite(fd, &fs_info, sizeof(fs_info), kBytesPerSector);
+        }
+
+        FATDirectory entries[kBytesPerSector / 32];
+        pread(fd, entries, sizeof(entries), ClusterOffset(parent));
+        auto slot = 0;
+        while (entries[slot].DIR_Name.name[0] != 0)
+            slot++;
+        entries[slot] = {};
+        memcpy(&entries[slot].DIR_Name, name, 11);
+        entries[slot].DIR_Attr = 0x10;
+        entries[slot].DIR_FstClusHI = first_cluster >> 16;
+        entries[slot].DIR_FstClusLO = first_cluster & 0xFFFF;
+        pwrite(fd, entries, sizeof(entries), ClusterOffset(parent));
+        close(fd);
+        return first_cluster;
+    }
+
+    FsckResult Fsck() const {
+        FsckResult result;
+        std::vector<uint8_t> image;
+        if (auto file = fopen(path_.c_str(), "rb")) {
+            uint8_t buffer[1 << 16];
+            size_t size;
+            while ((size = fread(buffer, 1, sizeof(buffer), file)) > 0)
+                image.insert(image.end(), buffer, buffer + size);
+            fclose(file);
+        }
+
+        auto fat_sectors = FATSectors(kClusters);
+        auto fat_bytes = fat_sectors * kBytesPerSector;
+        auto fat = reinterpret_cast<const uint32_t *>(
+            image.data() + kReservedSectors * kBytesPerSector);
+        auto data = image.data() +
+                    (kReservedSectors + 2 * fat_sectors) * kBytesPerSector;
+        auto entry = [&](uint32_t c) { return fat[c] & 0x0FFFFFFF; };
+
+        result.mirrors_match =
+            memcmp(fat, reinterpret_cast<const uint8_t *>(fat) + fat_bytes,
+                   fat_bytes) == 0;
+        result.fsinfo_free =
+            reinterpret_cast<const FSInfo *>(image.data() + kBytesPerSector)
+                ->FSI_Free_Count;
+
+        std::vector<bool> reached(kClusters + 2);
+        // marks the chain and returns its clusters
+        auto walk = [&](uint32_t c) {
+            std::vector<uint32_t> chain;
+            while (c >= 2 && c < kClusters + 2) {
+                if (reached[c]) {
+                    result.cross_linked++;
+                    break;
+                }
+                reached[c] = true;
+                chain.push_back(c);
+                c = entry(c);
+            }
+            return chain;
+        };
+
+        std::vector<uint32_t> dirs = {2};
+        while (!dirs.empty()) {
+            auto dir = dirs.back();
+            dirs.pop_back();
+            for (auto cluster : walk(dir)) {
+                auto entries = reinterpret_cast<const FATDirectory *>(
+                    data + (cluster - 2) * kBytesPerSector);
+                for (uint32_t i = 0; i < kBytesPerSector / 32; i++) {
+                    auto &e = entries[i];
+                    auto first = e.DIR_Name.name[0];
+                    if (first == 0)
+                        break;
+                    if (first == 0xE5 || first == '.' ||
+                        (e.DIR_Attr & 0x3F) == 0x0F || (e.DIR_Attr & 0x08))
+                        continue;
+                    auto start = uint32_t(e.DIR_FstClusHI) << 16 |
+                                 e.DIR_FstClusLO;
+                    if (e.DIR_Attr & 0x10)
+                        dirs.push_back(start);
+                    else
+                        walk(start);
+                }
+            }
+        }
+
+        for (uint32_t c = 2; c < kClusters + 2; c++) {
+            if (entry(c) == 0)
+                result.free_entries++;
+            else if (!reached[c])
+                result.leaked++;
+        }
+        return result;
+    }
+};
+
+} // namespace cs5250::test
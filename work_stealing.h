@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace cs5250 {
+
+// Runs function(worker, item, push) for every item on `threads` threads,
+// starting with `items`. push(item) queues more work at the back of the
+// calling worker's deque; a worker pops from the back of its own deque and
+// steals from the front of the others when it runs dry.
+template <typename T, typename F>
+void RunWorkStealing(unsigned threads, std::vector<T> items, F &&function) {
+    struct Queue {
+        std::mutex mutex;
+        std::deque<T> items;
+    };
+    if (threads == 0)
+        threads = 1;
+    std::vector<Queue> queues(threads);
+    // items queued or running; it only drops to zero once all are done
+    std::atomic<size_t> pending = items.size();
+    for (size_t i = 0; i < items.size(); i++)
+        queues[i % threads].items.push_back(std::move(items[i]));
+
+    auto worker = [&](unsigned self) {
+        auto push = [&](T item) {
+            pending++;
+            std::lock_guard lock(queues[self].mutex);
+            queues[self].items.push_back(std::move(item));
+        };
+
+        while (pending > 0) {
+            std::optional<T> item;
+            {
+                std::lock_guard lock(queues[self].mutex);
+                if (!queues[self].items.empty()) {
+                    item = std::move(queues[self].items.back());
+                    queues[self].items.pop_back();
+                }
+            }
+            for (unsigned k = 1; !item && k < threads; k++) {
+                auto &victim = queues[(self + k) % threads];
+                std::lock_guard lock(victim.mutex);
+                if (!victim.items.empty()) {
+                    item = std::move(victim.items.front());
+                    victim.items.pop_front();
+                }
+            }
+            if (!item) {
+                std::this_thread::yield();
+                continue;
+            }
+            function(self, *item, push);
+            pending--;
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads; t++)
+        workers.emplace_back(worker, t);
+    worker(0);
+    for (auto &thread : workers)
+        thread.join();
+}
+
+} // namespace cs5250